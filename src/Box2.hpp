@@ -66,6 +66,11 @@ public:
         return !isBoxOutside(other);
     }
 
+    Box2F unionWithBox(const Box2F &other) const
+    {
+        return Box2F(std::min(min, other.min), std::max(max, other.max));
+    }
+
     Ray2F::IntersectionResult intersectionWithRay(const Ray2F &ray)
     {
         // Slab testing algorithm from: A Ray-Box Intersection Algorithm andEfficient Dynamic Voxel Rendering
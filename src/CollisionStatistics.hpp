@@ -0,0 +1,124 @@
+#ifndef COLLISION_STATISTICS_HPP
+#define COLLISION_STATISTICS_HPP
+
+#include "Entity.hpp"
+#include <stdint.h>
+#include <string.h>
+
+// The counting of the collision queries is compiled out of the release builds,
+// unless it is enabled explicitly by defining this as 1.
+#ifndef ENABLE_COLLISION_STATISTICS
+#ifdef NDEBUG
+#define ENABLE_COLLISION_STATISTICS 0
+#else
+#define ENABLE_COLLISION_STATISTICS 1
+#endif
+#endif
+
+// The weight of the last tick in the rolling averages.
+#define CollisionStatisticsRollingFactor (1.0f/32.0f)
+
+enum class CollisionQueryKind : uint8_t {
+    BoxOverlap,
+    SweptBox,
+    EntityScan,
+    SensorPass,
+
+    Count,
+};
+
+enum {
+    NumberOfCollisionQueryKinds = (int)CollisionQueryKind::Count,
+
+    // The queries done outside of the entity updates are counted in the first caller.
+    NoCollisionQueryCaller = 0,
+    NumberOfCollisionQueryCallers = NumberOfEntityBehaviorTypes + 1,
+};
+
+inline uint32_t collisionQueryCallerForBehaviorType(EntityBehaviorType type)
+{
+    return uint32_t(type) + 1;
+}
+
+struct CollisionQueryCounters
+{
+    uint32_t calls;
+    uint32_t tilesVisited; // The tiles read by the overlaps, and the colliders tested by the sweeps.
+    uint32_t entityBoxesTested;
+    uint32_t hits;
+
+    void add(const CollisionQueryCounters &other)
+    {
+        calls += other.calls;
+        tilesVisited += other.tilesVisited;
+        entityBoxesTested += other.entityBoxesTested;
+        hits += other.hits;
+    }
+};
+
+struct CollisionQueryAverages
+{
+    float calls;
+    float tilesVisited;
+    float entityBoxesTested;
+    float hits;
+};
+
+// The counters of each query kind, per calling behavior type.
+struct CollisionStatistics
+{
+    CollisionQueryCounters currentTick[NumberOfCollisionQueryKinds][NumberOfCollisionQueryCallers];
+    CollisionQueryCounters lastTick[NumberOfCollisionQueryKinds][NumberOfCollisionQueryCallers];
+    CollisionQueryAverages rollingAverages[NumberOfCollisionQueryKinds];
+    uint32_t currentCaller;
+
+    void setCurrentCaller(Entity *entity)
+    {
+        currentCaller = entity ? collisionQueryCallerForBehaviorType(entity->type) : uint32_t(NoCollisionQueryCaller);
+    }
+
+    CollisionQueryCounters &counters(CollisionQueryKind kind)
+    {
+        return currentTick[(int)kind][currentCaller];
+    }
+
+    CollisionQueryCounters lastTickTotal(CollisionQueryKind kind) const
+    {
+        CollisionQueryCounters result = {};
+        for(int i = 0; i < NumberOfCollisionQueryCallers; ++i)
+            result.add(lastTick[(int)kind][i]);
+        return result;
+    }
+
+    CollisionQueryCounters lastTickTotalOfCaller(uint32_t caller) const
+    {
+        CollisionQueryCounters result = {};
+        for(int i = 0; i < NumberOfCollisionQueryKinds; ++i)
+            result.add(lastTick[i][caller]);
+        return result;
+    }
+
+    void finishTick()
+    {
+        memcpy(lastTick, currentTick, sizeof(lastTick));
+        memset(currentTick, 0, sizeof(currentTick));
+
+        for(int i = 0; i < NumberOfCollisionQueryKinds; ++i)
+        {
+            auto total = lastTickTotal(CollisionQueryKind(i));
+            auto &average = rollingAverages[i];
+            average.calls += (total.calls - average.calls)*CollisionStatisticsRollingFactor;
+            average.tilesVisited += (total.tilesVisited - average.tilesVisited)*CollisionStatisticsRollingFactor;
+            average.entityBoxesTested += (total.entityBoxesTested - average.entityBoxesTested)*CollisionStatisticsRollingFactor;
+            average.hits += (total.hits - average.hits)*CollisionStatisticsRollingFactor;
+        }
+    }
+};
+
+#if ENABLE_COLLISION_STATISTICS
+#define COUNT_COLLISION_QUERY(kind, counter, amount) (global.mapTransientState->collisionStatistics.counters(CollisionQueryKind::kind).counter += (amount))
+#else
+#define COUNT_COLLISION_QUERY(kind, counter, amount) ((void)0)
+#endif
+
+#endif //COLLISION_STATISTICS_HPP
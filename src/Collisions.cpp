@@ -1,40 +1,1028 @@
 #include "Collisions.hpp"
 #include "GameLogic.hpp"
 #include "MapTransientState.hpp"
+#include <algorithm>
+#include <vector>
+#include <string.h>
 
-bool isWorldBoxCollidingWithMapTileLayer(const Box2F &box, const MapFileTileLayer *tileLayer)
+#if defined(USE_SSE2_COLLISION_RAY_BATCH) || defined(USE_SSE2_COLLISION_GRID_KERNELS)
+#include <emmintrin.h>
+#endif
+
+void initializeCollisionGrid(const Vector2F &mapExtent)
+{
+    global.mapTransientState->collisionRayBatch = newTransient<CollisionRayBatch> ();
+    beginCollisionRayBatch();
+
+    auto &grid = global.mapTransientState->collisionGrid;
+    grid.extent = std::max(Vector2I(1, 1), (mapExtent/CollisionGridCellSize).floor().asVector2I() + 1);
+
+    auto cellCount = grid.extent.x*grid.extent.y;
+    grid.cells = reinterpret_cast<MapCollisionGridCell*> (allocateTransientBytes(cellCount*sizeof(MapCollisionGridCell)));
+    for(int32_t i = 0; i < cellCount; ++i)
+        new (&grid.cells[i]) MapCollisionGridCell();
+}
+
+static Box2I collisionGridCellsForBox(const MapCollisionGridState &grid, const Box2F &box)
+{
+    auto lastCell = grid.extent - 1;
+    auto minCell = std::min(lastCell, std::max(Vector2I::zeros(), (box.min/CollisionGridCellSize).floor().asVector2I()));
+    auto maxCell = std::min(lastCell, std::max(Vector2I::zeros(), (box.max/CollisionGridCellSize).floor().asVector2I()));
+    return Box2I(minCell, maxCell + 1);
+}
+
+template<typename FT>
+static void collisionGridCellsDo(MapCollisionGridState &grid, const Box2I &cells, const FT &f)
+{
+    for(int32_t y = cells.min.y; y < cells.max.y; ++y)
+    {
+        auto cellRow = grid.cells + y*grid.extent.x;
+        for(int32_t x = cells.min.x; x < cells.max.x; ++x)
+            f(cellRow[x]);
+    }
+}
+
+static void addEntityToCollisionGridCells(MapCollisionGridState &grid, Entity *entity)
+{
+    auto box = entity->boundingBox();
+    auto cells = collisionGridCellsForBox(grid, box);
+    entity->collisionGridCells = cells;
+
+    bool fitsInCells = true;
+    collisionGridCellsDo(grid, cells, [&](MapCollisionGridCell &cell) {
+        if(cell.entities.size() >= cell.entities.capacity())
+            fitsInCells = false;
+    });
+
+    entity->isInCollisionGridOverflow = !fitsInCells;
+    if(!fitsInCells)
+    {
+        grid.overflowEntities.push_back(entity);
+        return;
+    }
+
+    collisionGridCellsDo(grid, cells, [&](MapCollisionGridCell &cell) {
+        cell.addEntity(entity, box);
+    });
+}
+
+static void removeEntityFromCollisionGridCells(MapCollisionGridState &grid, Entity *entity)
+{
+    auto isTheEntity = [=](Entity *each) {
+        return each == entity;
+    };
+
+    if(entity->isInCollisionGridOverflow)
+    {
+        grid.overflowEntities.removeAllThat(isTheEntity);
+        return;
+    }
+
+    collisionGridCellsDo(grid, entity->collisionGridCells, [&](MapCollisionGridCell &cell) {
+        cell.removeEntity(entity);
+    });
+}
+
+void insertEntityIntoCollisionGrid(Entity *entity)
+{
+    auto &grid = global.mapTransientState->collisionGrid;
+    entity->collisionSequenceNumber = ++grid.lastSequenceNumber;
+    addEntityToCollisionGridCells(grid, entity);
+}
+
+void updateEntityInCollisionGrid(Entity *entity)
+{
+    if(!entity->collisionSequenceNumber)
+        return;
+
+    auto &grid = global.mapTransientState->collisionGrid;
+    auto oldCells = entity->collisionGridCells;
+    auto box = entity->boundingBox();
+    auto newCells = collisionGridCellsForBox(grid, box);
+    if(!entity->isInCollisionGridOverflow &&
+        oldCells.min.x == newCells.min.x && oldCells.min.y == newCells.min.y &&
+        oldCells.max.x == newCells.max.x && oldCells.max.y == newCells.max.y)
+    {
+        collisionGridCellsDo(grid, oldCells, [&](MapCollisionGridCell &cell) {
+            cell.setEntityBox(entity, box);
+        });
+        return;
+    }
+
+    removeEntityFromCollisionGridCells(grid, entity);
+    addEntityToCollisionGridCells(grid, entity);
+}
+
+void removeEntityFromCollisionGrid(Entity *entity)
+{
+    if(!entity->collisionSequenceNumber)
+        return;
+
+    removeEntityFromCollisionGridCells(global.mapTransientState->collisionGrid, entity);
+    entity->collisionSequenceNumber = 0;
+}
+
+// Visits once each collision entity near the box with a category in the mask. The visitor returns true to stop.
+template<typename FT>
+static void collisionGridCandidatesInBoxDo(const Box2F &box, uint16_t categoryMask, const FT &f)
+{
+    auto &grid = global.mapTransientState->collisionGrid;
+    auto stamp = ++grid.queryStamp;
+    auto cells = collisionGridCellsForBox(grid, box.grownWithHalfExtent(CollisionGridQueryMargin));
+    for(int32_t y = cells.min.y; y < cells.max.y; ++y)
+    {
+        auto cellRow = grid.cells + y*grid.extent.x;
+        for(int32_t x = cells.min.x; x < cells.max.x; ++x)
+        {
+            for(auto entity : cellRow[x].entities)
+            {
+                if(entity->collisionQueryStamp == stamp || !(entity->collisionCategory & categoryMask))
+                    continue;
+
+                entity->collisionQueryStamp = stamp;
+                if(f(entity))
+                    return;
+            }
+        }
+    }
+
+    for(auto entity : grid.overflowEntities)
+    {
+        if(!(entity->collisionCategory & categoryMask))
+            continue;
+        if(f(entity))
+            return;
+    }
+}
+
+void collectCollisionEntitiesInBox(const Box2F &box, uint16_t categoryMask, CollisionEntityList &outEntities)
+{
+    outEntities.clear();
+    collisionGridCandidatesInBoxDo(box, categoryMask, [&](Entity *entity) {
+        outEntities.push_back(entity);
+        return false;
+    });
+
+    // Keep the order of the linear scan, so ties are broken in the same way.
+    std::sort(outEntities.begin(), outEntities.end(), [](Entity *a, Entity *b) {
+        return a->collisionSequenceNumber < b->collisionSequenceNumber;
+    });
+}
+
+//============================================================================
+// Collision grid cell kernels
+//============================================================================
+
+static uint32_t lowestBitIndex(uint32_t mask)
+{
+    uint32_t result = 0;
+    for(; !(mask & 1); mask >>= 1)
+        ++result;
+    return result;
+}
+
+#if ENABLE_COLLISION_STATISTICS
+static uint32_t bitCount(uint32_t mask)
+{
+    uint32_t result = 0;
+    for(; mask; mask &= mask - 1)
+        ++result;
+    return result;
+}
+#endif
+
+#ifdef USE_SSE2_COLLISION_GRID_KERNELS
+
+// The slab test of Box2F::intersectionWithRay for the four lanes. The operands of
+// the min and max are swapped, to keep the results of std::min and std::max.
+static __m128 intersectRayLanesWithBoxLanes(__m128 originX, __m128 originY, __m128 inverseDirectionX, __m128 inverseDirectionY, __m128 minT, __m128 maxT,
+    __m128 minX, __m128 minY, __m128 maxX, __m128 maxY, __m128 &outT)
+{
+    auto t0x = _mm_mul_ps(_mm_sub_ps(minX, originX), inverseDirectionX);
+    auto t0y = _mm_mul_ps(_mm_sub_ps(minY, originY), inverseDirectionY);
+    auto t1x = _mm_mul_ps(_mm_sub_ps(maxX, originX), inverseDirectionX);
+    auto t1y = _mm_mul_ps(_mm_sub_ps(maxY, originY), inverseDirectionY);
+
+    auto tminX = _mm_min_ps(t1x, t0x);
+    auto tminY = _mm_min_ps(t1y, t0y);
+    auto tmaxX = _mm_max_ps(t1x, t0x);
+    auto tmaxY = _mm_max_ps(t1y, t0y);
+
+    auto maxTMin = _mm_max_ps(minT, _mm_max_ps(tminY, tminX));
+    auto minTMax = _mm_min_ps(maxT, _mm_min_ps(tmaxY, tmaxX));
+
+    outT = _mm_min_ps(minTMax, maxTMin);
+    return _mm_cmple_ps(maxTMin, minTMax);
+}
+
+// The entries of the cell with a category in the mask.
+static uint32_t collisionGridCellEntriesInCategories(const MapCollisionGridCell &cell, uint16_t categoryMask)
+{
+    auto mask = _mm_set1_epi32(categoryMask);
+    auto zero = _mm_setzero_si128();
+
+    uint32_t result = 0;
+    for(uint32_t first = 0; first < cell.entities.size(); first += 4)
+    {
+        auto categories = _mm_and_si128(_mm_load_si128(reinterpret_cast<const __m128i*> (cell.categories + first)), mask);
+        result |= uint32_t(~_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(categories, zero))) & 15) << first;
+    }
+
+    return result & cell.entriesMask();
+}
+
+// The candidate entries of the cell whose box overlaps the box, with the comparisons of Box2F::intersectsWithBox.
+// The groups of four entries without candidates are skipped.
+static uint32_t collisionGridCellEntriesOverlappingBox(const MapCollisionGridCell &cell, const Box2F &box, uint32_t candidates)
+{
+    auto boxMinX = _mm_set1_ps(box.min.x);
+    auto boxMinY = _mm_set1_ps(box.min.y);
+    auto boxMaxX = _mm_set1_ps(box.max.x);
+    auto boxMaxY = _mm_set1_ps(box.max.y);
+
+    uint32_t result = 0;
+    for(uint32_t first = 0; first < cell.entities.size(); first += 4)
+    {
+        if(!((candidates >> first) & 15))
+            continue;
+
+        auto outside = _mm_or_ps(
+            _mm_or_ps(_mm_cmplt_ps(boxMaxX, _mm_load_ps(cell.minX + first)), _mm_cmpgt_ps(boxMinX, _mm_load_ps(cell.maxX + first))),
+            _mm_or_ps(_mm_cmplt_ps(boxMaxY, _mm_load_ps(cell.minY + first)), _mm_cmpgt_ps(boxMinY, _mm_load_ps(cell.maxY + first))));
+        result |= uint32_t(~_mm_movemask_ps(outside) & 15) << first;
+    }
+
+    return result & candidates;
+}
+
+// The candidate entries of the cell whose box, grown by the half extent, is hit by the ray, and their distances.
+// The boxes are grown with the same operations as Box2F::grownWithHalfExtent.
+static uint32_t collisionGridCellEntriesHitByRay(const MapCollisionGridCell &cell, const Vector2F &boxHalfExtent, const Ray2F &ray, uint32_t candidates, float *outDistances)
+{
+    auto originX = _mm_set1_ps(ray.origin.x);
+    auto originY = _mm_set1_ps(ray.origin.y);
+    auto inverseDirectionX = _mm_set1_ps(ray.inverseDirection.x);
+    auto inverseDirectionY = _mm_set1_ps(ray.inverseDirection.y);
+    auto minT = _mm_set1_ps(ray.minT);
+    auto maxT = _mm_set1_ps(ray.maxT);
+    auto extraHalfExtentX = _mm_set1_ps(boxHalfExtent.x);
+    auto extraHalfExtentY = _mm_set1_ps(boxHalfExtent.y);
+    auto half = _mm_set1_ps(0.5f);
+
+    uint32_t result = 0;
+    for(uint32_t first = 0; first < cell.entities.size(); first += 4)
+    {
+        if(!((candidates >> first) & 15))
+            continue;
+
+        auto minX = _mm_load_ps(cell.minX + first);
+        auto minY = _mm_load_ps(cell.minY + first);
+        auto halfExtentX = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(cell.maxX + first), minX), half);
+        auto halfExtentY = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(cell.maxY + first), minY), half);
+        auto centerX = _mm_add_ps(minX, halfExtentX);
+        auto centerY = _mm_add_ps(minY, halfExtentY);
+        auto grownHalfExtentX = _mm_add_ps(halfExtentX, extraHalfExtentX);
+        auto grownHalfExtentY = _mm_add_ps(halfExtentY, extraHalfExtentY);
+
+        __m128 t;
+        auto hit = intersectRayLanesWithBoxLanes(originX, originY, inverseDirectionX, inverseDirectionY, minT, maxT,
+            _mm_sub_ps(centerX, grownHalfExtentX), _mm_sub_ps(centerY, grownHalfExtentY),
+            _mm_add_ps(centerX, grownHalfExtentX), _mm_add_ps(centerY, grownHalfExtentY), t);
+        _mm_store_ps(outDistances + first, t);
+        result |= uint32_t(_mm_movemask_ps(hit)) << first;
+    }
+
+    return result & candidates;
+}
+
+#else
+
+static Box2F collisionGridCellBoxAt(const MapCollisionGridCell &cell, size_t index)
+{
+    return Box2F(Vector2F(cell.minX[index], cell.minY[index]), Vector2F(cell.maxX[index], cell.maxY[index]));
+}
+
+static uint32_t collisionGridCellEntriesInCategories(const MapCollisionGridCell &cell, uint16_t categoryMask)
+{
+    uint32_t result = 0;
+    for(size_t i = 0; i < cell.entities.size(); ++i)
+    {
+        if(cell.categories[i] & categoryMask)
+            result |= 1u << i;
+    }
+    return result;
+}
+
+static uint32_t collisionGridCellEntriesOverlappingBox(const MapCollisionGridCell &cell, const Box2F &box, uint32_t candidates)
+{
+    uint32_t result = 0;
+    for(; candidates; candidates &= candidates - 1)
+    {
+        auto i = lowestBitIndex(candidates);
+        if(collisionGridCellBoxAt(cell, i).intersectsWithBox(box))
+            result |= 1u << i;
+    }
+    return result;
+}
+
+static uint32_t collisionGridCellEntriesHitByRay(const MapCollisionGridCell &cell, const Vector2F &boxHalfExtent, const Ray2F &ray, uint32_t candidates, float *outDistances)
+{
+    uint32_t result = 0;
+    for(; candidates; candidates &= candidates - 1)
+    {
+        auto i = lowestBitIndex(candidates);
+        auto intersectionResult = collisionGridCellBoxAt(cell, i).grownWithHalfExtent(boxHalfExtent).intersectionWithRay(ray);
+        outDistances[i] = intersectionResult.second;
+        if(intersectionResult.first)
+            result |= 1u << i;
+    }
+    return result;
+}
+
+#endif
+
+// The entries of the cell that the query accepts, so that the kernels only test them.
+static uint32_t collisionGridCellCandidatesForQuery(const MapCollisionGridCell &cell, const CollisionQuery &query)
+{
+    auto result = collisionGridCellEntriesInCategories(cell, query.categoryMask);
+    for(auto entries = result; entries; entries &= entries - 1)
+    {
+        auto index = lowestBitIndex(entries);
+        if(query.excludes(cell.entities[index]))
+            result &= ~(1u << index);
+    }
+    return result;
+}
+
+static void addSensorContactIfOverlapping(Entity *sensor, Entity *entity, MapTransientState *mapState)
+{
+    if((sensor->collisionMask & entity->collisionCategory) == 0)
+        return;
+
+    COUNT_COLLISION_QUERY(SensorPass, entityBoxesTested, 1);
+    if(!entity->boundingBox().intersectsWithBox(sensor->boundingBox()))
+        return;
+
+    auto &contacts = mapState->newSensorContacts;
+    if(contacts.size() >= contacts.capacity())
+    {
+        ++mapState->droppedSensorContactCount;
+        return;
+    }
+
+    contacts.push_back(MapSensorContact{sensor, entity});
+}
+
+static bool isSensorContactBefore(const MapSensorContact &a, const MapSensorContact &b)
+{
+    if(a.sensor != b.sensor)
+        return std::less<Entity*>()(a.sensor, b.sensor);
+    return a.entity->collisionSequenceNumber < b.entity->collisionSequenceNumber;
+}
+
+void updateSensorContacts()
+{
+    auto mapState = global.mapTransientState;
+    auto &entities = mapState->sensorContactEntities;
+
+    // The order of the previous tick is almost sorted, so an insertion sort is cheap.
+    for(size_t i = 1; i < entities.size(); ++i)
+    {
+        auto entity = entities[i];
+        auto minX = entity->boundingBox().min.x;
+        auto j = i;
+        for(; j > 0 && entities[j - 1]->boundingBox().min.x > minX; --j)
+            entities[j] = entities[j - 1];
+        entities[j] = entity;
+    }
+
+    // Sweep along x, keeping the sensors and the other entities whose interval is still open.
+    auto &contacts = mapState->newSensorContacts;
+    auto &openSensors = mapState->openSensors;
+    auto &openEntities = mapState->openSensorContactEntities;
+    contacts.clear();
+    openSensors.clear();
+    openEntities.clear();
+    for(auto entity : entities)
+    {
+        if(entity->isDead())
+            continue;
+
+        auto minX = entity->boundingBox().min.x;
+        auto isClosed = [&](Entity *openEntity) {
+            return openEntity->boundingBox().max.x < minX;
+        };
+        openSensors.removeAllThat(isClosed);
+        openEntities.removeAllThat(isClosed);
+
+        if(entity->isSensor())
+        {
+            for(auto openEntity : openEntities)
+                addSensorContactIfOverlapping(entity, openEntity, mapState);
+            openSensors.push_back(entity);
+        }
+        else
+        {
+            for(auto openSensor : openSensors)
+                addSensorContactIfOverlapping(openSensor, entity, mapState);
+            openEntities.push_back(entity);
+        }
+    }
+    std::sort(contacts.begin(), contacts.end(), isSensorContactBefore);
+    COUNT_COLLISION_QUERY(SensorPass, calls, 1);
+    COUNT_COLLISION_QUERY(SensorPass, hits, contacts.size());
+
+    // Compare with the contacts of the previous tick. Both lists are sorted.
+    auto &oldContacts = mapState->sensorContacts;
+    size_t oldIndex = 0;
+    size_t newIndex = 0;
+    while(oldIndex < oldContacts.size() || newIndex < contacts.size())
+    {
+        if(newIndex >= contacts.size() ||
+            (oldIndex < oldContacts.size() && isSensorContactBefore(oldContacts[oldIndex], contacts[newIndex])))
+        {
+            auto &contact = oldContacts[oldIndex++];
+            contact.sensor->endContact(contact.entity);
+        }
+        else if(oldIndex >= oldContacts.size() || isSensorContactBefore(contacts[newIndex], oldContacts[oldIndex]))
+        {
+            auto &contact = contacts[newIndex++];
+            contact.sensor->beginContact(contact.entity);
+        }
+        else
+        {
+            auto &contact = contacts[newIndex++];
+            ++oldIndex;
+            contact.sensor->stayContact(contact.entity);
+        }
+    }
+
+    // The dead entities are removed at the end of the tick, so their contacts end now.
+    oldContacts.clear();
+    for(auto &contact : contacts)
+    {
+        if(contact.sensor->isDead() || contact.entity->isDead())
+            contact.sensor->endContact(contact.entity);
+        else
+            oldContacts.push_back(contact);
+    }
+}
+
+template<typename TG>
+static bool isWorldBoxCollidingWithSolidLayer(const Box2F &box, const MapSolidLayerState *solidLayer, const TG &tileGeometry)
+{
+    // Every tile in the bounding integer box touches the box, so only the occupancy matters.
+    auto tileLayer = solidLayer->mapTileLayer;
+    auto boxInTileSpace = tileLayer->boxFromWorldIntoTileSpace(box, tileGeometry);
+    auto tileGridBox = boxInTileSpace.asBoundingIntegerBox().intersectionWithBox(tileLayer->tileGridBounds());
+    if(tileGridBox.isEmpty())
+        return false;
+    if(solidLayer->isTileBoxFarFromSolid(tileGridBox))
+    {
+        COUNT_COLLISION_QUERY(BoxOverlap, tilesVisited, 1);
+        return false;
+    }
+
+    // Only the boxes that touch a mixed block without touching a full one need the tiles.
+    auto blockOccupancy = solidLayer->blockOccupancyOfTileBox(tileGridBox);
+    if(blockOccupancy != TileBlockOccupancy::Mixed)
+    {
+        COUNT_COLLISION_QUERY(BoxOverlap, tilesVisited, 1);
+        return blockOccupancy == TileBlockOccupancy::Full;
+    }
+
+    COUNT_COLLISION_QUERY(BoxOverlap, tilesVisited, tileGridBox.extent().x*tileGridBox.extent().y);
+    return solidLayer->hasOccupiedTileInBox(tileGridBox);
+}
+
+static bool isWorldBoxCollidingWithSolidLayer(const Box2F &box, const MapSolidLayerState *solidLayer)
+{
+    auto tileExtent = global.mainTileSet.tileExtent;
+    if(isDefaultTileExtent(tileExtent))
+        return isWorldBoxCollidingWithSolidLayer(box, solidLayer, DefaultTileGeometry());
+    return isWorldBoxCollidingWithSolidLayer(box, solidLayer, DynamicTileGeometry(tileExtent));
+}
+
+bool isBoxCollidingWithWorld(const Box2F &box)
+{
+    auto mapState = global.mapTransientState;
+    if(!mapState)
+        return false;
+
+    COUNT_COLLISION_QUERY(BoxOverlap, calls, 1);
+    for(auto layer : mapState->layers)
+    {
+        if(layer->type != MapLayerType::Solid)
+            continue;
+
+        auto solidLayer = reinterpret_cast<MapSolidLayerState*> (layer);
+        if(!solidLayer->mapTileLayer->isSolid())
+            continue;
+
+        if(isWorldBoxCollidingWithSolidLayer(box, solidLayer))
+        {
+            COUNT_COLLISION_QUERY(BoxOverlap, hits, 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool isBoxCollidingWithSolidEntity(const Box2F &box, const CollisionQuery &query)
+{
+    auto mapState = global.mapTransientState;
+    if(!mapState)
+        return false;
+
+    COUNT_COLLISION_QUERY(EntityScan, calls, 1);
+
+    // The entries of each cell are filtered before testing the boxes of the remaining ones together.
+    auto &grid = mapState->collisionGrid;
+    bool hasCollision = false;
+    collisionGridCellsDo(grid, collisionGridCellsForBox(grid, box.grownWithHalfExtent(CollisionGridQueryMargin)), [&](MapCollisionGridCell &cell) {
+        if(hasCollision)
+            return;
+
+        auto candidates = collisionGridCellCandidatesForQuery(cell, query);
+        if(!candidates)
+            return;
+
+        COUNT_COLLISION_QUERY(EntityScan, entityBoxesTested, bitCount(candidates));
+        hasCollision = collisionGridCellEntriesOverlappingBox(cell, box, candidates) != 0;
+    });
+
+    for(size_t i = 0; i < grid.overflowEntities.size() && !hasCollision; ++i)
+    {
+        auto entity = grid.overflowEntities[i];
+        if(!query.acceptsCategory(entity->collisionCategory) || query.excludes(entity))
+            continue;
+
+        COUNT_COLLISION_QUERY(EntityScan, entityBoxesTested, 1);
+        hasCollision = entity->boundingBox().intersectsWithBox(box);
+    }
+
+    if(hasCollision)
+        COUNT_COLLISION_QUERY(EntityScan, hits, 1);
+    return hasCollision;
+}
+
+bool isBoxCollidingWithSolid(const Box2F &box, const CollisionQuery &query)
+{
+    return (query.includesWorld() && isBoxCollidingWithWorld(box)) ||
+        (query.includesEntities() && isBoxCollidingWithSolidEntity(box, query));
+}
+
+// Greedy merging of the occupied tiles into rectangles. Each rectangle first
+// grows along its row, and then downwards while the whole span is free. Their
+// size is capped, to keep the bounding volume hierarchy tight.
+static void mergeOccupiedTilesIntoRectangles(const MapSolidLayerState *solidLayer, std::vector<Box2I> &outRectangles)
+{
+    auto extent = solidLayer->mapTileLayer->extent;
+    auto wordsPerRow = solidLayer->occupancyWordsPerRow;
+    std::vector<uint64_t> remaining(solidLayer->occupancy, solidLayer->occupancy + wordsPerRow*extent.y);
+    auto isRemaining = [&](int32_t x, int32_t y) {
+        return (remaining[y*wordsPerRow + (x >> 6)] >> (x & 63)) & 1;
+    };
+
+    for(int32_t y = 0; y < extent.y; ++y)
+    {
+        for(int32_t x = 0; x < extent.x; ++x)
+        {
+            if(!isRemaining(x, y))
+                continue;
+
+            auto endX = x + 1;
+            while(endX < extent.x && endX - x < MaxColliderTileExtent && isRemaining(endX, y))
+                ++endX;
+
+            auto endY = y + 1;
+            for(; endY < extent.y && endY - y < MaxColliderTileExtent; ++endY)
+            {
+                bool isSpanRemaining = true;
+                for(int32_t sx = x; sx < endX && isSpanRemaining; ++sx)
+                    isSpanRemaining = isRemaining(sx, endY);
+                if(!isSpanRemaining)
+                    break;
+            }
+
+            for(int32_t ry = y; ry < endY; ++ry)
+            {
+                for(int32_t rx = x; rx < endX; ++rx)
+                    remaining[ry*wordsPerRow + (rx >> 6)] &= ~(uint64_t(1) << (rx & 63));
+            }
+
+            outRectangles.push_back(Box2I(Vector2I(x, y), Vector2I(endX, endY)));
+            x = endX - 1;
+        }
+    }
+}
+
+static void buildColliderBVHNode(std::vector<MapColliderBVHNode> &nodes, uint32_t nodeIndex, std::vector<Box2F> &colliders, uint32_t first, uint32_t count)
+{
+    auto bounds = colliders[first];
+    auto centerBounds = Box2F(bounds.center(), bounds.center());
+    for(uint32_t i = first + 1; i < first + count; ++i)
+    {
+        bounds = bounds.unionWithBox(colliders[i]);
+        centerBounds = centerBounds.unionWithBox(Box2F(colliders[i].center(), colliders[i].center()));
+    }
+
+    nodes[nodeIndex].bounds = bounds;
+    if(count <= MaxNumberOfCollidersPerBVHLeaf)
+    {
+        nodes[nodeIndex].firstIndex = first;
+        nodes[nodeIndex].colliderCount = count;
+        return;
+    }
+
+    // Split at the median along the longest axis of the centers.
+    auto centerExtent = centerBounds.extent();
+    auto splitOnX = centerExtent.x >= centerExtent.y;
+    auto middle = count / 2;
+    std::nth_element(colliders.begin() + first, colliders.begin() + first + middle, colliders.begin() + first + count, [=](const Box2F &a, const Box2F &b) {
+        return splitOnX ? a.center().x < b.center().x : a.center().y < b.center().y;
+    });
+
+    uint32_t childIndex = nodes.size();
+    nodes[nodeIndex].firstIndex = childIndex;
+    nodes[nodeIndex].colliderCount = 0;
+    nodes.resize(nodes.size() + 2);
+    buildColliderBVHNode(nodes, childIndex, colliders, first, middle);
+    buildColliderBVHNode(nodes, childIndex + 1, colliders, first + middle, count - middle);
+}
+
+void buildSolidLayerColliders(MapSolidLayerState *solidLayer)
+{
+    std::vector<Box2I> rectangles;
+    mergeOccupiedTilesIntoRectangles(solidLayer, rectangles);
+    if(rectangles.empty())
+        return;
+
+    auto tileLayer = solidLayer->mapTileLayer;
+    auto tileGeometry = DynamicTileGeometry(global.mainTileSet.tileExtent);
+    std::vector<Box2F> colliders;
+    colliders.reserve(rectangles.size());
+    for(auto &rectangle : rectangles)
+        colliders.push_back(tileLayer->boxFromTileIntoWorldSpace(Box2F(rectangle.min.asVector2F(), rectangle.max.asVector2F()), tileGeometry));
+
+    std::vector<MapColliderBVHNode> nodes(1);
+    buildColliderBVHNode(nodes, 0, colliders, 0, colliders.size());
+
+    solidLayer->colliderCount = colliders.size();
+    solidLayer->colliders = reinterpret_cast<Box2F*> (allocateTransientBytes(colliders.size()*sizeof(Box2F)));
+    std::copy(colliders.begin(), colliders.end(), solidLayer->colliders);
+
+    solidLayer->colliderNodeCount = nodes.size();
+    solidLayer->colliderNodes = reinterpret_cast<MapColliderBVHNode*> (allocateTransientBytes(nodes.size()*sizeof(MapColliderBVHNode)));
+    std::copy(nodes.begin(), nodes.end(), solidLayer->colliderNodes);
+
+    // The colliders were reordered by the hierarchy. Their corners are whole tiles.
+    auto extent = tileLayer->extent;
+    solidLayer->tileColliderIndices = reinterpret_cast<uint32_t*> (allocateTransientBytes(extent.x*extent.y*sizeof(uint32_t)));
+    for(uint32_t i = 0; i < colliders.size(); ++i)
+    {
+        auto tileBox = tileLayer->boxFromWorldIntoTileSpace(colliders[i], tileGeometry).asBoundingIntegerBox();
+        for(int32_t y = tileBox.min.y; y < tileBox.max.y; ++y)
+        {
+            for(int32_t x = tileBox.min.x; x < tileBox.max.x; ++x)
+                solidLayer->tileColliderIndices[y*extent.x + x] = i;
+        }
+    }
+}
+
+void buildSolidLayerDistanceField(MapSolidLayerState *solidLayer)
+{
+    auto extent = solidLayer->mapTileLayer->extent;
+    solidLayer->solidDistance = reinterpret_cast<uint8_t*> (allocateTransientBytes(extent.x*extent.y));
+
+    // Two chamfer passes with unit weights, which are exact for the Chebyshev distance.
+    auto distance = [&](int32_t x, int32_t y) -> uint8_t& {
+        return solidLayer->solidDistance[y*extent.x + x];
+    };
+    auto relax = [&](int32_t x, int32_t y, int32_t neighborX, int32_t neighborY) {
+        if(neighborX < 0 || neighborX >= extent.x || neighborY < 0 || neighborY >= extent.y)
+            return;
+        distance(x, y) = std::min(int32_t(distance(x, y)), int32_t(distance(neighborX, neighborY)) + 1);
+    };
+
+    for(int32_t y = 0; y < extent.y; ++y)
+    {
+        for(int32_t x = 0; x < extent.x; ++x)
+        {
+            distance(x, y) = solidLayer->isTileOccupied(x, y) ? 0 : MaxSolidTileDistance;
+            relax(x, y, x - 1, y);
+            relax(x, y, x - 1, y - 1);
+            relax(x, y, x, y - 1);
+            relax(x, y, x + 1, y - 1);
+        }
+    }
+
+    for(int32_t y = extent.y - 1; y >= 0; --y)
+    {
+        for(int32_t x = extent.x - 1; x >= 0; --x)
+        {
+            relax(x, y, x + 1, y);
+            relax(x, y, x + 1, y + 1);
+            relax(x, y, x, y + 1);
+            relax(x, y, x - 1, y + 1);
+        }
+    }
+}
+
+void buildSolidLayerBlockOccupancy(MapSolidLayerState *solidLayer)
+{
+    auto tileLayer = solidLayer->mapTileLayer;
+    auto extent = tileLayer->extent;
+    auto blockExtent = (extent + (TileOccupancyBlockSize - 1)) / TileOccupancyBlockSize;
+    solidLayer->blockExtent = blockExtent;
+    solidLayer->blockOccupancy = reinterpret_cast<TileBlockOccupancy*> (allocateTransientBytes(blockExtent.x*blockExtent.y*sizeof(TileBlockOccupancy)));
+
+    for(int32_t blockY = 0; blockY < blockExtent.y; ++blockY)
+    {
+        for(int32_t blockX = 0; blockX < blockExtent.x; ++blockX)
+        {
+            auto blockMin = Vector2I(blockX, blockY)*TileOccupancyBlockSize;
+            auto tiles = Box2I(blockMin, std::min(blockMin + TileOccupancyBlockSize, extent));
+
+            int32_t occupiedCount = 0;
+            for(int32_t y = tiles.min.y; y < tiles.max.y; ++y)
+            {
+                for(int32_t x = tiles.min.x; x < tiles.max.x; ++x)
+                    occupiedCount += tileLayer->tiles[y*extent.x + x] != 0 ? 1 : 0;
+            }
+
+            auto &occupancy = solidLayer->blockOccupancy[blockY*blockExtent.x + blockX];
+            if(occupiedCount == 0)
+                occupancy = TileBlockOccupancy::Empty;
+            else if(occupiedCount == tiles.extent().x*tiles.extent().y)
+                occupancy = TileBlockOccupancy::Full;
+            else
+                occupancy = TileBlockOccupancy::Mixed;
+        }
+    }
+}
+
+// Sphere tracing with the distance field. The empty tiles around the tile of the box center
+// span [tile - distance + 1, tile + distance), so the box can advance until it reaches their border.
+// Returns true when the whole sweep stays away from the solid tiles.
+template<typename TG>
+static bool isSweptBoxClearOfSolidLayer(const Vector2F &boxHalfExtent, const Ray2F &ray, const MapSolidLayerState *solidLayer, const TG &tileGeometry)
+{
+    auto tileLayer = solidLayer->mapTileLayer;
+    auto halfExtentInTiles = boxHalfExtent*tileGeometry.tilesPerUnit();
+    auto tilesPerUnitOfT = ray.direction.abs()*tileGeometry.tilesPerUnit();
+
+    auto t = ray.minT;
+    for(uint32_t i = 0; i < MaxNumberOfSolidDistanceSweepSteps; ++i)
+    {
+        auto center = tileLayer->pointFromWorldIntoTileSpace(ray.pointAtT(t), tileGeometry);
+        auto tile = center.floor().asVector2I();
+        if(tile.x < 0 || tile.y < 0 || tile.x >= tileLayer->extent.x || tile.y >= tileLayer->extent.y)
+            return false;
+
+        auto distance = solidLayer->solidDistanceAt(tile.x, tile.y);
+        auto emptyMin = (tile - distance + 1).asVector2F();
+        auto emptyMax = (tile + distance).asVector2F();
+        auto slack = std::min(center - halfExtentInTiles - emptyMin, emptyMax - center - halfExtentInTiles) - SolidDistanceSweepMargin;
+        if(slack.x <= 0.0f || slack.y <= 0.0f)
+            return false;
+
+        t += std::min(slack.x / tilesPerUnitOfT.x, slack.y / tilesPerUnitOfT.y);
+        if(t >= ray.maxT)
+            return true;
+    }
+
+    return false;
+}
+
+static bool isSweptBoxClearOfSolidLayer(const Vector2F &boxHalfExtent, const Ray2F &ray, const MapSolidLayerState *solidLayer)
 {
-    auto tileLayerExtent = tileLayer->extent;
     auto tileExtent = global.mainTileSet.tileExtent;
-    auto boxInTileSpace = tileLayer->boxFromWorldIntoTileSpace(box, tileExtent.asVector2F());
-    auto tileGridBox = boxInTileSpace.asBoundingIntegerBox().intersectionWithBox(tileLayer->tileGridBounds());
+    if(isDefaultTileExtent(tileExtent))
+        return isSweptBoxClearOfSolidLayer(boxHalfExtent, ray, solidLayer, DefaultTileGeometry());
+    return isSweptBoxClearOfSolidLayer(boxHalfExtent, ray, solidLayer, DynamicTileGeometry(tileExtent));
+}
+
+static Ray2F queryRayFor(const Ray2F &ray, const CollisionQuery &query)
+{
+    auto result = ray;
+    result.maxT = std::min(ray.maxT, query.maxDistance);
+    return result;
+}
+
+// Amanatides-Woo traversal of the tiles crossed by the center of the box. While
+// the center is in a cell, only the tiles under the cell grown by the box half
+// extent can be hit. The colliders that cover them are tested like in the
+// hierarchy, so the internal edges between the tiles are not hit either. The
+// ties are broken by the collider index. Returns true when the query is done.
+template<typename TG>
+static bool sweepCollisionBoxAlongRayWithSolidLayerTiles(const Vector2F &boxHalfExtent, const Ray2F &ray, const MapSolidLayerState *solidLayer, const TG &tileGeometry, const CollisionQuery &query, CollisionSweepTestResult &outResult)
+{
+    auto tileLayer = solidLayer->mapTileLayer;
+    auto tileRay = tileLayer->rayFromWorldIntoTileSpace(ray, tileGeometry);
+    auto tileRayStartPoint = tileRay.startPoint();
+    auto tileRayEndPoint = tileRay.endPoint();
+    auto footprintHalfExtent = tileLayer->vectorFromWorldIntoTileSpace(boxHalfExtent, tileGeometry) + CollisionTraversalFootprintMargin;
+    auto tileGridBox = Box2F(std::min(tileRayStartPoint, tileRayEndPoint), std::max(tileRayStartPoint, tileRayEndPoint))
+        .grownWithHalfExtent(footprintHalfExtent).asBoundingIntegerBox().intersectionWithBox(tileLayer->tileGridBounds());
+    if(tileGridBox.isEmpty())
+        return false;
+
+    auto cell = tileRayStartPoint.floor().asVector2I();
+    Vector2I cellStep;
+    Vector2F nextCellT;
+    Vector2F cellDeltaT;
+    if(tileRay.direction.x > 0.0f)
+    {
+        cellStep.x = 1;
+        nextCellT.x = (cell.x + 1 - tileRay.origin.x)*tileRay.inverseDirection.x;
+        cellDeltaT.x = tileRay.inverseDirection.x;
+    }
+    else if(tileRay.direction.x < 0.0f)
+    {
+        cellStep.x = -1;
+        nextCellT.x = (cell.x - tileRay.origin.x)*tileRay.inverseDirection.x;
+        cellDeltaT.x = -tileRay.inverseDirection.x;
+    }
+    else
+    {
+        cellStep.x = 0;
+        nextCellT.x = INFINITY;
+        cellDeltaT.x = INFINITY;
+    }
+
+    if(tileRay.direction.y > 0.0f)
+    {
+        cellStep.y = 1;
+        nextCellT.y = (cell.y + 1 - tileRay.origin.y)*tileRay.inverseDirection.y;
+        cellDeltaT.y = tileRay.inverseDirection.y;
+    }
+    else if(tileRay.direction.y < 0.0f)
+    {
+        cellStep.y = -1;
+        nextCellT.y = (cell.y - tileRay.origin.y)*tileRay.inverseDirection.y;
+        cellDeltaT.y = -tileRay.inverseDirection.y;
+    }
+    else
+    {
+        cellStep.y = 0;
+        nextCellT.y = INFINITY;
+        cellDeltaT.y = INFINITY;
+    }
+
+    // The tile ray spans the same segment as the world ray, with another scale.
+    auto worldTPerTileT = tileRay.maxT > 0.0f ? (ray.maxT - ray.minT) / tileRay.maxT : 0.0f;
 
-    auto sourceRow = tileLayer->tiles + tileGridBox.min.y*tileLayerExtent.x + tileGridBox.min.x;
-    for(int32_t ty = tileGridBox.min.y; ty < tileGridBox.max.y; ++ty)
+    bool hasLayerHit = false;
+    uint32_t hitColliderIndex = 0;
+    FixedVector<uint32_t, MaxNumberOfTraversalTestedColliders> testedColliders;
+    auto layerWidth = tileLayer->extent.x;
+    auto previousFootprint = Box2I(Vector2I::zeros(), Vector2I::zeros());
+    for(;;)
     {
-        auto source = sourceRow;
-        for(int32_t tx = tileGridBox.min.x; tx < tileGridBox.max.x; ++tx)
+        // The footprints move monotonically, so a tile that is not in the previous footprint has not been visited yet.
+        auto cellBox = Box2F(cell.asVector2F(), (cell + 1).asVector2F()).grownWithHalfExtent(footprintHalfExtent);
+        auto footprint = cellBox.asBoundingIntegerBox().intersectionWithBox(tileGridBox);
+        for(int32_t ty = footprint.min.y; ty < footprint.max.y; ++ty)
         {
-            auto tileIndex = *source++;
-            if(tileIndex == 0)
-                continue;
+            auto isInPreviousRow = previousFootprint.min.y <= ty && ty < previousFootprint.max.y;
+            for(int32_t tx = footprint.min.x; tx < footprint.max.x; ++tx)
+            {
+                if(!solidLayer->isTileOccupied(tx, ty))
+                    continue;
+                if(isInPreviousRow && previousFootprint.min.x <= tx && tx < previousFootprint.max.x)
+                    continue;
+
+                // A collider spans many tiles. When the list is full, it may be tested again.
+                auto colliderIndex = solidLayer->tileColliderIndices[ty*layerWidth + tx];
+                if(testedColliders.includes(colliderIndex))
+                    continue;
+                testedColliders.push_back(colliderIndex);
+
+                COUNT_COLLISION_QUERY(SweptBox, tilesVisited, 1);
+                auto colliderBox = solidLayer->colliders[colliderIndex].grownWithHalfExtent(boxHalfExtent);
+                auto intersectionResult = colliderBox.intersectionWithRay(ray);
+                if(!intersectionResult.first)
+                    continue;
 
-            auto tileBox = Box2F(Vector2F(tx, ty), Vector2F(tx + 1, ty + 1));
-            if(boxInTileSpace.intersectsWithBox(tileBox))
-                return true;
+                auto isCloser = !outResult.hasCollision || intersectionResult.second < outResult.collisionDistance ||
+                    (hasLayerHit && intersectionResult.second == outResult.collisionDistance && colliderIndex < hitColliderIndex);
+                if(!isCloser)
+                    continue;
+
+                hasLayerHit = true;
+                hitColliderIndex = colliderIndex;
+                outResult.hasCollision = true;
+                outResult.collisionDistance = intersectionResult.second;
+                outResult.collidingEntity = nullptr;
+                outResult.collidingBox = colliderBox;
+                if(query.stopsAtFirstHit())
+                    return true;
+            }
         }
+        previousFootprint = footprint;
 
-        sourceRow += tileLayerExtent.x;
+        // Stop at the end of the ray, or when the next cells cannot have a closer hit.
+        auto cellExitT = std::min(nextCellT.x, nextCellT.y);
+        if(cellExitT > tileRay.maxT)
+            break;
+        if(outResult.hasCollision && ray.minT + cellExitT*worldTPerTileT > outResult.collisionDistance + CollisionTraversalStopEpsilon)
+            break;
+
+        if(nextCellT.x < nextCellT.y)
+        {
+            cell.x += cellStep.x;
+            nextCellT.x += cellDeltaT.x;
+        }
+        else
+        {
+            cell.y += cellStep.y;
+            nextCellT.y += cellDeltaT.y;
+        }
     }
+
     return false;
 }
 
-bool isBoxCollidingWithWorld(const Box2F &box)
+static bool sweepCollisionBoxAlongRayWithSolidLayerTiles(const Vector2F &boxHalfExtent, const Ray2F &ray, const MapSolidLayerState *solidLayer, const CollisionQuery &query, CollisionSweepTestResult &outResult)
 {
-    auto mapState = global.mapTransientState;
-    if(!mapState)
+    auto tileExtent = global.mainTileSet.tileExtent;
+    if(isDefaultTileExtent(tileExtent))
+        return sweepCollisionBoxAlongRayWithSolidLayerTiles(boxHalfExtent, ray, solidLayer, DefaultTileGeometry(), query, outResult);
+    return sweepCollisionBoxAlongRayWithSolidLayerTiles(boxHalfExtent, ray, solidLayer, DynamicTileGeometry(tileExtent), query, outResult);
+}
+
+static bool isShortCollisionSweep(const Ray2F &ray)
+{
+    return ray.maxT - ray.minT <= CollisionTraversalMaxSweepLength;
+}
+
+// Returns true when the query is done.
+static bool sweepCollisionBoxAlongRayWithSolidLayer(const Vector2F &boxHalfExtent, const Ray2F &ray, const MapSolidLayerState *solidLayer, const CollisionQuery &query, CollisionSweepTestResult &outResult)
+{
+    if(!solidLayer->colliderNodeCount || isSweptBoxClearOfSolidLayer(boxHalfExtent, ray, solidLayer))
         return false;
 
+    // The per tick moves only cross a few tiles, where the walk is cheaper than the
+    // hierarchy. The long rays, like the line of sight, use the hierarchy.
+    if(isShortCollisionSweep(ray))
+        return sweepCollisionBoxAlongRayWithSolidLayerTiles(boxHalfExtent, ray, solidLayer, query, outResult);
+
+    // The nodes are culled against the swept box before doing the more expensive slab test.
+    auto sweptBox = Box2F(std::min(ray.startPoint(), ray.endPoint()), std::max(ray.startPoint(), ray.endPoint()))
+        .grownWithHalfExtent(boxHalfExtent);
+
+    FixedVector<uint32_t, MaxColliderBVHDepth*2> nodeStack;
+    nodeStack.push_back(0);
+    while(!nodeStack.empty())
+    {
+        auto &node = solidLayer->colliderNodes[nodeStack.back()];
+        nodeStack.pop_back();
+
+        auto nodeBounds = node.bounds.grownWithHalfExtent(boxHalfExtent);
+        if(!nodeBounds.intersectsWithBox(sweptBox))
+            continue;
+
+        auto nodeResult = nodeBounds.intersectionWithRay(ray);
+        if(!nodeResult.first || (outResult.hasCollision && nodeResult.second >= outResult.collisionDistance))
+            continue;
+
+        if(!node.colliderCount)
+        {
+            nodeStack.push_back(node.firstIndex + 1);
+            nodeStack.push_back(node.firstIndex);
+            continue;
+        }
+
+        COUNT_COLLISION_QUERY(SweptBox, tilesVisited, node.colliderCount);
+        for(uint32_t i = node.firstIndex; i < node.firstIndex + node.colliderCount; ++i)
+        {
+            auto colliderBox = solidLayer->colliders[i].grownWithHalfExtent(boxHalfExtent);
+            auto intersectionResult = colliderBox.intersectionWithRay(ray);
+            if(intersectionResult.first && (!outResult.hasCollision || intersectionResult.second < outResult.collisionDistance))
+            {
+                outResult.hasCollision = true;
+                outResult.collisionDistance = intersectionResult.second;
+                outResult.collidingEntity = nullptr;
+                outResult.collidingBox = colliderBox;
+                if(query.stopsAtFirstHit())
+                    return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+void sweepCollisionBoxAlongRayWithWorld(const Vector2F &boxHalfExtent, const Ray2F &ray, const CollisionQuery &query, CollisionSweepTestResult &outResult)
+{
+    auto mapState = global.mapTransientState;
+    if(!mapState || !query.includesWorld())
+        return;
+
+    auto queryRay = queryRayFor(ray, query);
+    COUNT_COLLISION_QUERY(SweptBox, calls, 1);
+
     for(auto layer : mapState->layers)
     {
         if(layer->type != MapLayerType::Solid)
@@ -44,144 +1032,595 @@ bool isBoxCollidingWithWorld(const Box2F &box)
         if(!solidLayer->mapTileLayer->isSolid())
             continue;
 
-        if(isWorldBoxCollidingWithMapTileLayer(box, solidLayer->mapTileLayer))
-            return true;
+        if(sweepCollisionBoxAlongRayWithSolidLayer(boxHalfExtent, queryRay, solidLayer, query, outResult))
+            break;
     }
-    return false;
+
+    if(outResult.hasCollision)
+        COUNT_COLLISION_QUERY(SweptBox, hits, 1);
 }
 
-bool isBoxCollidingWithSolidEntity(const Box2F &box, const std::unordered_set<Entity*> &exclusionSet)
+void sweepCollisionBoxAlongRayWithCollidingEntities(const Vector2F &boxHalfExtent, const Ray2F &ray, const CollisionQuery &query, CollisionSweepTestResult &outResult)
 {
     auto mapState = global.mapTransientState;
-    if(!mapState)
-        return false;
+    if(!mapState || !query.includesEntities())
+        return;
+
+    auto queryRay = queryRayFor(ray, query);
+    auto rayBoundingBox = Box2F(std::min(queryRay.startPoint(), queryRay.endPoint()), std::max(queryRay.startPoint(), queryRay.endPoint()))
+        .grownWithHalfExtent(boxHalfExtent);
+
+    COUNT_COLLISION_QUERY(EntityScan, calls, 1);
+
+    // The hits are found cell by cell, and the one kept is the one that a scan in the
+    // order of the sequence numbers would find: the first one, or the closest one with
+    // the ties broken by that order.
+    Entity *hitEntity = nullptr;
+    float hitDistance = 0.0f;
+    auto addHit = [&](Entity *entity, float distance) {
+        if(outResult.hasCollision && !(distance < outResult.collisionDistance))
+            return;
+
+        if(hitEntity)
+        {
+            auto isBefore = entity->collisionSequenceNumber < hitEntity->collisionSequenceNumber;
+            if(query.stopsAtFirstHit() ? !isBefore : !(distance < hitDistance || (distance == hitDistance && isBefore)))
+                return;
+        }
+
+        hitEntity = entity;
+        hitDistance = distance;
+    };
+
+    auto &grid = mapState->collisionGrid;
+    collisionGridCellsDo(grid, collisionGridCellsForBox(grid, rayBoundingBox.grownWithHalfExtent(CollisionGridQueryMargin)), [&](MapCollisionGridCell &cell) {
+        auto candidates = collisionGridCellCandidatesForQuery(cell, query);
+        if(!candidates)
+            return;
+
+        alignas(16) float distances[MaxNumberOfEntitiesPerCollisionGridCell];
+        COUNT_COLLISION_QUERY(EntityScan, entityBoxesTested, bitCount(candidates));
+        for(auto entries = collisionGridCellEntriesHitByRay(cell, boxHalfExtent, queryRay, candidates, distances); entries; entries &= entries - 1)
+        {
+            auto index = lowestBitIndex(entries);
+            addHit(cell.entities[index], distances[index]);
+        }
+    });
 
-    for(auto entity : mapState->collisionEntities)
+    for(auto entity : grid.overflowEntities)
     {
-        if(exclusionSet.find(entity) != exclusionSet.end())
+        if(!query.acceptsCategory(entity->collisionCategory) || query.excludes(entity))
             continue;
 
-        if(entity->boundingBox().intersectsWithBox(box))
-            return true;
+        COUNT_COLLISION_QUERY(EntityScan, entityBoxesTested, 1);
+        auto intersectionResult = entity->boundingBox().grownWithHalfExtent(boxHalfExtent).intersectionWithRay(queryRay);
+        if(intersectionResult.first)
+            addHit(entity, intersectionResult.second);
     }
 
-    return false;
-}
+    if(!hitEntity)
+        return;
 
-bool isBoxCollidingWithSolid(const Box2F &box, const std::unordered_set<Entity*> &exclusionSet)
-{
-    return isBoxCollidingWithWorld(box) || isBoxCollidingWithSolidEntity(box, exclusionSet);
+    outResult.hasCollision = true;
+    outResult.collisionDistance = hitDistance;
+    outResult.collidingBox = hitEntity->boundingBox().grownWithHalfExtent(boxHalfExtent);
+    outResult.collidingEntity = hitEntity;
+    COUNT_COLLISION_QUERY(EntityScan, hits, 1);
 }
 
-bool isBoxCollidingWithSolid(const Box2F &box)
+void sweepCollisionBoxAlongRay(const Vector2F &boxHalfExtent, const Ray2F &ray, const CollisionQuery &query, CollisionSweepTestResult &outResult)
 {
-    return isBoxCollidingWithSolid(box, std::unordered_set<Entity*> ());
+    sweepCollisionBoxAlongRayWithWorld(boxHalfExtent, ray, query, outResult);
+    if(outResult.hasCollision && query.stopsAtFirstHit())
+        return;
+
+    sweepCollisionBoxAlongRayWithCollidingEntities(boxHalfExtent, ray, query, outResult);
 }
 
-void sweepCollisionBoxAlongRayWithWorldWithMapTileLayer(const Vector2F &boxHalfExtent, const Ray2F &ray, const MapFileTileLayer *tileLayer, CollisionSweepTestResult &outResult)
+//============================================================================
+// Target shadow fields
+//============================================================================
+
+// The union of the shadows cast so far, as sorted and disjoint intervals of slopes.
+struct TargetShadowSlopeIntervals
 {
-    auto tileLayerExtent = tileLayer->extent;
-    auto tileExtent = global.mainTileSet.tileExtent.asVector2F();
+    enum {
+        Capacity = TargetShadowFieldExtent*TargetShadowFieldRadius,
+    };
 
-    auto tileRay = tileLayer->rayFromWorldIntoTileSpace(ray, tileExtent);
-    auto tileRayStartPoint = tileRay.startPoint();
-    auto tileRayEndPoint = tileRay.endPoint();
+    float minSlopes[Capacity];
+    float maxSlopes[Capacity];
+    uint32_t count;
+
+    // The tested intervals must come in increasing order, and the cursor follows them.
+    bool contains(uint32_t &cursor, float minSlope, float maxSlope) const
+    {
+        while(cursor < count && maxSlopes[cursor] < maxSlope)
+            ++cursor;
+        return cursor < count && minSlopes[cursor] <= minSlope;
+    }
+
+    void add(float minSlope, float maxSlope)
+    {
+        uint32_t first = 0;
+        while(first < count && maxSlopes[first] < minSlope)
+            ++first;
 
-    auto extraTileHalfExtent = tileLayer->vectorFromWorldIntoTileSpace(boxHalfExtent, tileExtent);
+        uint32_t last = first;
+        for(; last < count && minSlopes[last] <= maxSlope; ++last)
+        {
+            minSlope = std::min(minSlope, minSlopes[last]);
+            maxSlope = std::max(maxSlope, maxSlopes[last]);
+        }
+
+        // The new interval replaces the ones that it overlaps. Dropping it is conservative.
+        if(first == last)
+        {
+            if(count >= Capacity)
+                return;
+            std::copy_backward(minSlopes + first, minSlopes + count, minSlopes + count + 1);
+            std::copy_backward(maxSlopes + first, maxSlopes + count, maxSlopes + count + 1);
+            ++count;
+        }
+        else
+        {
+            std::copy(minSlopes + last, minSlopes + count, minSlopes + first + 1);
+            std::copy(maxSlopes + last, maxSlopes + count, maxSlopes + first + 1);
+            count -= last - first - 1;
+        }
+
+        minSlopes[first] = minSlope;
+        maxSlopes[first] = maxSlope;
+    }
+};
+
+// The interval of v/u over the box [u0, u1]x[v0, v1], with u0 > 0, from the inverses of u0 and u1.
+static void slopeIntervalOfBox(float inverseU0, float inverseU1, float v0, float v1, float &outMinSlope, float &outMaxSlope)
+{
+    outMinSlope = std::min(v0*inverseU0, v0*inverseU1);
+    outMaxSlope = std::max(v1*inverseU0, v1*inverseU1);
+}
 
-    auto tileRayBoundingBox = Box2F(std::min(tileRayStartPoint, tileRayEndPoint), std::max(tileRayStartPoint, tileRayEndPoint)).grownWithHalfExtent(extraTileHalfExtent);
-    auto tileGridBox = tileRayBoundingBox.asBoundingIntegerBox().intersectionWithBox(tileLayer->tileGridBounds());
+// Shadowcasting from the target towards each side, one row of tiles at a time. A
+// segment from the target crosses a box in front of it when its slope is in the
+// slopes of the box, so a tile is in shadow when its slopes are covered by the
+// shadows of the runs of solid tiles in the rows before it. Each side only visits
+// the tiles around its two octants, the others are visited by the next side.
+template<typename TG>
+static void computeTargetShadowField(MapTargetShadowField &field, const MapSolidLayerState *solidLayer, const TG &tileGeometry)
+{
+    auto tileLayer = solidLayer->mapTileLayer;
+    auto tileOrigin = tileLayer->pointFromWorldIntoTileSpace(field.origin, tileGeometry);
+    auto originTile = tileOrigin.floor().asVector2I();
 
-    //printf("ray %f %f -> %f %f\n", ray.origin.x, ray.origin.y, ray.direction.x, ray.direction.y);
-    //printf("tileRay %f %f -> %f %f\n", tileRay.origin.x, tileRay.origin.y, tileRay.direction.x, tileRay.direction.y);
+    field.windowMin = originTile - TargetShadowFieldRadius;
+    field.isComputed = true;
+    memset(field.shadowRows, 0, sizeof(field.shadowRows));
 
-    //printf("extraTileHalfExtent %f %f\n", extraTileHalfExtent.x, extraTileHalfExtent.y);
-    //printf("tileRay %f %f %f %f\n", tileRayStartPoint.x, tileRayStartPoint.y, tileRayEndPoint.x, tileRayEndPoint.y);
-    //printf("tileRayBoundingBox %f %f %f %f\n", tileRayBoundingBox.min.x, tileRayBoundingBox.min.y, tileRayBoundingBox.max.x, tileRayBoundingBox.max.y);
-    //printf("tileGridBox %d %d %d %d\n", tileGridBox.min.x, tileGridBox.min.y, tileGridBox.max.x, tileGridBox.max.y);
+    // Nothing casts a shadow when the whole window is empty.
+    if(tileLayer->tileGridBounds().containsPointStrictly(originTile) &&
+        solidLayer->solidDistanceAt(originTile.x, originTile.y) > TargetShadowFieldRadius)
+        return;
 
-    auto sourceRow = tileLayer->tiles + tileGridBox.min.y*tileLayerExtent.x + tileGridBox.min.x;
-    for(int32_t ty = tileGridBox.min.y; ty < tileGridBox.max.y; ++ty)
+    auto testedTileMargin = TargetShadowOccluderMargin*0.5f;
+    TargetShadowSlopeIntervals shadows;
+    for(int axis = 0; axis < 2; ++axis)
     {
-        auto source = sourceRow;
-        for(int32_t tx = tileGridBox.min.x; tx < tileGridBox.max.x; ++tx)
-        {
-            auto tileIndex = *source++;
-            if(tileIndex == 0)
-                continue;
+        // The rows are along the axis a, and the tiles of a row along the axis b.
+        auto originA = axis == 0 ? tileOrigin.x : tileOrigin.y;
+        auto originB = axis == 0 ? tileOrigin.y : tileOrigin.x;
+        auto originTileA = axis == 0 ? originTile.x : originTile.y;
+        auto originTileB = axis == 0 ? originTile.y : originTile.x;
+        auto extentA = axis == 0 ? tileLayer->extent.x : tileLayer->extent.y;
+        auto extentB = axis == 0 ? tileLayer->extent.y : tileLayer->extent.x;
+        auto isSolidTile = [&](int32_t tileA, int32_t tileB) {
+            if(tileA < 0 || tileA >= extentA || tileB < 0 || tileB >= extentB)
+                return false;
+            return axis == 0 ? solidLayer->isTileOccupied(tileA, tileB) : solidLayer->isTileOccupied(tileB, tileA);
+        };
 
-            auto tileBox = Box2F(Vector2F(tx, ty), Vector2F(tx + 1, ty + 1)).grownWithHalfExtent(extraTileHalfExtent);
-            auto intersectionResult = tileBox.intersectionWithRay(tileRay);
-            //printf("Test tile box: %f %f %f %f: %d %f\n", tileBox.min.x, tileBox.min.y, tileBox.max.x, tileBox.max.y, intersectionResult.first, intersectionResult.second);
-            if(intersectionResult.first)
+        for(int32_t direction = -1; direction <= 1; direction += 2)
+        {
+            shadows.count = 0;
+            for(int32_t row = 1; row <= TargetShadowFieldRadius; ++row)
             {
-                auto intersectionPoint = tileRay.pointAtT(intersectionResult.second);
-                auto intersectionWorldPoint = tileLayer->pointFromTileIntoWorldSpace(intersectionPoint, tileExtent);
-                auto intersectionWorldT = ray.direction.dot(intersectionWorldPoint - ray.origin);
+                // The distances along the side to the near and the far border of the row.
+                auto tileA = originTileA + direction*row;
+                auto u0 = direction > 0 ? float(tileA) - originA : originA - float(tileA + 1);
+                auto u1 = u0 + 1.0f;
 
-                if(!outResult.hasCollision || intersectionWorldT < outResult.collisionDistance)
+                if(shadows.count && u0 - testedTileMargin > 0.0f)
                 {
-                    //printf("Intersection point: %f %f\n", intersectionPoint.x, intersectionPoint.y);
-                    //printf("intersectionWorldPoint: %f %f\n", intersectionWorldPoint.x, intersectionWorldPoint.y);
-                    //printf("intersectionWorldT: %f\n", intersectionWorldT);
-
-                    outResult.hasCollision = true;
-                    outResult.collisionDistance = intersectionWorldT;
-                    outResult.collidingEntity = nullptr;
-                    outResult.collidingBox = tileLayer->boxFromTileIntoWorldSpace(tileBox, tileExtent);
+                    auto inverseU0 = 1.0f/(u0 - testedTileMargin);
+                    auto inverseU1 = 1.0f/(u1 + testedTileMargin);
+                    auto reach = std::min(row + 1, int32_t(TargetShadowFieldRadius));
+                    uint32_t cursor = 0;
+                    for(auto tileB = originTileB - reach; tileB <= originTileB + reach; ++tileB)
+                    {
+                        auto v0 = float(tileB) - originB;
+                        float minSlope, maxSlope;
+                        slopeIntervalOfBox(inverseU0, inverseU1, v0 - testedTileMargin, v0 + 1.0f + testedTileMargin, minSlope, maxSlope);
+                        if(!shadows.contains(cursor, minSlope, maxSlope))
+                            continue;
+
+                        auto windowTile = (axis == 0 ? Vector2I(tileA, tileB) : Vector2I(tileB, tileA)) - field.windowMin;
+                        field.shadowRows[windowTile.y] |= uint64_t(1) << windowTile.x;
+                    }
                 }
 
+                // The runs of solid tiles of the row, shrunk by the margin, cast shadows on the next rows.
+                auto occluderReach = std::min(row + 2, int32_t(TargetShadowFieldRadius));
+                auto lastTileB = originTileB + occluderReach;
+                auto occluderInverseU0 = 1.0f/(u0 + TargetShadowOccluderMargin);
+                auto occluderInverseU1 = 1.0f/(u1 - TargetShadowOccluderMargin);
+                for(auto tileB = originTileB - occluderReach; tileB <= lastTileB; )
+                {
+                    if(!isSolidTile(tileA, tileB))
+                    {
+                        ++tileB;
+                        continue;
+                    }
+
+                    auto runStart = tileB;
+                    while(tileB <= lastTileB && isSolidTile(tileA, tileB))
+                        ++tileB;
+
+                    float minSlope, maxSlope;
+                    slopeIntervalOfBox(occluderInverseU0, occluderInverseU1,
+                        float(runStart) - originB + TargetShadowOccluderMargin, float(tileB) - originB - TargetShadowOccluderMargin,
+                        minSlope, maxSlope);
+                    shadows.add(minSlope, maxSlope);
+                }
             }
         }
+    }
+}
 
-        sourceRow += tileLayerExtent.x;
+static const MapSolidLayerState *firstSolidLayer()
+{
+    for(auto layer : global.mapTransientState->layers)
+    {
+        auto solidLayer = reinterpret_cast<MapSolidLayerState*> (layer);
+        if(layer->type == MapLayerType::Solid && solidLayer->mapTileLayer->isSolid())
+            return solidLayer;
+    }
+    return nullptr;
+}
+
+static MapTargetShadowField *findTargetShadowField(const Vector2F &targetPosition)
+{
+    for(auto &field : global.mapTransientState->targetShadowFields)
+    {
+        if(field.isValid && field.origin.x == targetPosition.x && field.origin.y == targetPosition.y)
+            return &field;
     }
+    return nullptr;
 }
 
-void sweepCollisionBoxAlongRayWithWorld(const Vector2F &boxHalfExtent, const Ray2F &ray, CollisionSweepTestResult &outResult)
+void addSightTestTowardsTarget(const Vector2F &targetPosition)
 {
     auto mapState = global.mapTransientState;
     if(!mapState)
         return;
 
-    for(auto layer : mapState->layers)
+    // The fields are kept by their exact origin, so the shadows of a target that
+    // does not move are kept. The least recently used field is replaced.
+    auto field = findTargetShadowField(targetPosition);
+    if(!field)
     {
-        if(layer->type != MapLayerType::Solid)
+        field = &mapState->targetShadowFields[0];
+        for(auto &each : mapState->targetShadowFields)
+        {
+            if(!each.isValid || (field->isValid && each.tick < field->tick))
+                field = &each;
+        }
+
+        field->origin = targetPosition;
+        field->isValid = true;
+        field->isComputed = false;
+        field->sightTestCount = 0;
+    }
+
+    if(field->tick != mapState->tickCount)
+    {
+        field->tick = mapState->tickCount;
+        field->sightTestCount = 0;
+    }
+    ++field->sightTestCount;
+}
+
+template<typename TG>
+static bool isPointInShadowOfTarget(MapTargetShadowField &field, const MapSolidLayerState *solidLayer, const Vector2F &point, const TG &tileGeometry)
+{
+    if(!field.isComputed)
+        computeTargetShadowField(field, solidLayer, tileGeometry);
+
+    auto tile = solidLayer->mapTileLayer->pointFromWorldIntoTileSpace(point, tileGeometry).floor().asVector2I();
+    return field.isTileInShadow(tile);
+}
+
+bool isPointInShadowOfTarget(const Vector2F &targetPosition, const Vector2F &point)
+{
+    auto mapState = global.mapTransientState;
+    if(!mapState)
+        return false;
+
+    // For a few tests, the rays are cheaper than the shadows.
+    auto field = findTargetShadowField(targetPosition);
+    if(!field || field->tick != mapState->tickCount || field->sightTestCount < MinNumberOfSightTestsForTargetShadowField)
+        return false;
+
+    // The shadows of any solid layer hide the target.
+    auto solidLayer = firstSolidLayer();
+    if(!solidLayer)
+        return false;
+
+    auto tileExtent = global.mainTileSet.tileExtent;
+    if(isDefaultTileExtent(tileExtent))
+        return isPointInShadowOfTarget(*field, solidLayer, point, DefaultTileGeometry());
+    return isPointInShadowOfTarget(*field, solidLayer, point, DynamicTileGeometry(tileExtent));
+}
+
+//============================================================================
+// Collision ray batch
+//============================================================================
+
+void beginCollisionRayBatch()
+{
+    global.mapTransientState->collisionRayBatch->count = 0;
+}
+
+uint32_t addRayToCollisionRayBatch(const Vector2F &boxHalfExtent, const Ray2F &ray, const CollisionQuery &query)
+{
+    auto &batch = *global.mapTransientState->collisionRayBatch;
+    if(!query.includesWorld() || batch.count >= MaxNumberOfBatchedCollisionRays)
+        return NoBatchedCollisionRay;
+
+    // The short rays walk the tiles instead of the hierarchy, so they are not batched.
+    if(isShortCollisionSweep(ray))
+        return NoBatchedCollisionRay;
+
+    auto index = batch.count++;
+    auto sweptBox = Box2F(std::min(ray.startPoint(), ray.endPoint()), std::max(ray.startPoint(), ray.endPoint()))
+        .grownWithHalfExtent(boxHalfExtent);
+
+    batch.rays[index] = ray;
+    batch.halfExtents[index] = boxHalfExtent;
+    batch.worldResults[index] = CollisionSweepTestResult();
+    batch.originX[index] = ray.origin.x;
+    batch.originY[index] = ray.origin.y;
+    batch.inverseDirectionX[index] = ray.inverseDirection.x;
+    batch.inverseDirectionY[index] = ray.inverseDirection.y;
+    batch.minT[index] = ray.minT;
+    batch.maxT[index] = ray.maxT;
+    batch.halfExtentX[index] = boxHalfExtent.x;
+    batch.halfExtentY[index] = boxHalfExtent.y;
+    batch.sweptMinX[index] = sweptBox.min.x;
+    batch.sweptMinY[index] = sweptBox.min.y;
+    batch.sweptMaxX[index] = sweptBox.max.x;
+    batch.sweptMaxY[index] = sweptBox.max.y;
+    return index;
+}
+
+#ifdef USE_SSE2_COLLISION_RAY_BATCH
+
+struct CollisionRayPacket
+{
+    __m128 originX, originY;
+    __m128 inverseDirectionX, inverseDirectionY;
+    __m128 minT, maxT;
+    __m128 halfExtentX, halfExtentY;
+    __m128 sweptMinX, sweptMinY, sweptMaxX, sweptMaxY;
+
+    // The closest hit of each lane.
+    __m128 hasCollision;
+    __m128 collisionDistance;
+    __m128i colliderIndex;
+    __m128i layerIndex;
+};
+
+struct CollisionRayPacketNode
+{
+    __m128 activeLanes;
+    uint32_t nodeIndex;
+};
+
+// The box grown by the half extent of each lane, computed with the same operations as Box2F::grownWithHalfExtent.
+static void growBoxForRayPacket(const CollisionRayPacket &packet, const Box2F &box, __m128 &outMinX, __m128 &outMinY, __m128 &outMaxX, __m128 &outMaxY)
+{
+    auto center = box.center();
+    auto halfExtent = box.halfExtent();
+    auto grownHalfExtentX = _mm_add_ps(_mm_set1_ps(halfExtent.x), packet.halfExtentX);
+    auto grownHalfExtentY = _mm_add_ps(_mm_set1_ps(halfExtent.y), packet.halfExtentY);
+    outMinX = _mm_sub_ps(_mm_set1_ps(center.x), grownHalfExtentX);
+    outMinY = _mm_sub_ps(_mm_set1_ps(center.y), grownHalfExtentY);
+    outMaxX = _mm_add_ps(_mm_set1_ps(center.x), grownHalfExtentX);
+    outMaxY = _mm_add_ps(_mm_set1_ps(center.y), grownHalfExtentY);
+}
+
+static __m128 intersectRayPacketWithBox(const CollisionRayPacket &packet, __m128 minX, __m128 minY, __m128 maxX, __m128 maxY, __m128 &outT)
+{
+    return intersectRayLanesWithBoxLanes(packet.originX, packet.originY, packet.inverseDirectionX, packet.inverseDirectionY, packet.minT, packet.maxT,
+        minX, minY, maxX, maxY, outT);
+}
+
+static __m128 selectLanes(__m128 mask, __m128 a, __m128 b)
+{
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+static __m128i selectLanes(__m128 mask, __m128i a, __m128i b)
+{
+    auto integerMask = _mm_castps_si128(mask);
+    return _mm_or_si128(_mm_and_si128(integerMask, a), _mm_andnot_si128(integerMask, b));
+}
+
+#if ENABLE_COLLISION_STATISTICS
+static uint32_t countActiveLanes(int laneMask)
+{
+    return (laneMask & 1) + ((laneMask >> 1) & 1) + ((laneMask >> 2) & 1) + ((laneMask >> 3) & 1);
+}
+#endif
+
+// The same traversal as sweepCollisionBoxAlongRayWithSolidLayer, where each lane
+// only descends into the nodes that its scalar traversal would visit.
+static void sweepRayPacketWithSolidLayer(CollisionRayPacket &packet, __m128 activeLanes, const MapSolidLayerState *solidLayer, int32_t layerIndex)
+{
+    if(!solidLayer->colliderNodeCount)
+        return;
+
+    FixedVector<CollisionRayPacketNode, MaxColliderBVHDepth*2> nodeStack;
+    nodeStack.push_back(CollisionRayPacketNode{activeLanes, 0});
+    while(!nodeStack.empty())
+    {
+        auto stackTop = nodeStack.back();
+        nodeStack.pop_back();
+        auto &node = solidLayer->colliderNodes[stackTop.nodeIndex];
+
+        __m128 minX, minY, maxX, maxY;
+        growBoxForRayPacket(packet, node.bounds, minX, minY, maxX, maxY);
+
+        auto outside = _mm_or_ps(
+            _mm_or_ps(_mm_cmplt_ps(packet.sweptMaxX, minX), _mm_cmpgt_ps(packet.sweptMinX, maxX)),
+            _mm_or_ps(_mm_cmplt_ps(packet.sweptMaxY, minY), _mm_cmpgt_ps(packet.sweptMinY, maxY)));
+
+        __m128 nodeT;
+        auto nodeHit = intersectRayPacketWithBox(packet, minX, minY, maxX, maxY, nodeT);
+        auto isFarther = _mm_and_ps(packet.hasCollision, _mm_cmpge_ps(nodeT, packet.collisionDistance));
+        auto lanes = _mm_andnot_ps(_mm_or_ps(outside, isFarther), _mm_and_ps(stackTop.activeLanes, nodeHit));
+        if(!_mm_movemask_ps(lanes))
             continue;
 
-        auto solidLayer = reinterpret_cast<MapSolidLayerState*> (layer);
-        if(!solidLayer->mapTileLayer->isSolid())
+        if(!node.colliderCount)
+        {
+            nodeStack.push_back(CollisionRayPacketNode{lanes, node.firstIndex + 1});
+            nodeStack.push_back(CollisionRayPacketNode{lanes, node.firstIndex});
             continue;
+        }
+
+        COUNT_COLLISION_QUERY(SweptBox, tilesVisited, node.colliderCount*countActiveLanes(_mm_movemask_ps(lanes)));
+        for(uint32_t i = node.firstIndex; i < node.firstIndex + node.colliderCount; ++i)
+        {
+            growBoxForRayPacket(packet, solidLayer->colliders[i], minX, minY, maxX, maxY);
+
+            __m128 colliderT;
+            auto colliderHit = intersectRayPacketWithBox(packet, minX, minY, maxX, maxY, colliderT);
+            auto isCloser = _mm_or_ps(_mm_andnot_ps(packet.hasCollision, _mm_castsi128_ps(_mm_set1_epi32(-1))), _mm_cmplt_ps(colliderT, packet.collisionDistance));
+            auto updatedLanes = _mm_and_ps(_mm_and_ps(lanes, colliderHit), isCloser);
+            if(!_mm_movemask_ps(updatedLanes))
+                continue;
 
-        sweepCollisionBoxAlongRayWithWorldWithMapTileLayer(boxHalfExtent, ray, solidLayer->mapTileLayer, outResult);
+            packet.hasCollision = _mm_or_ps(packet.hasCollision, updatedLanes);
+            packet.collisionDistance = selectLanes(updatedLanes, colliderT, packet.collisionDistance);
+            packet.colliderIndex = selectLanes(updatedLanes, _mm_set1_epi32(i), packet.colliderIndex);
+            packet.layerIndex = selectLanes(updatedLanes, _mm_set1_epi32(layerIndex), packet.layerIndex);
+        }
     }
 }
 
-void sweepCollisionBoxAlongRayWithCollidingEntities(const Vector2F &boxHalfExtent, const Ray2F &ray, CollisionSweepTestResult &outResult)
+void sweepCollisionRayBatchWithWorld()
 {
     auto mapState = global.mapTransientState;
     if(!mapState)
         return;
 
-    for(auto entity : mapState->collisionEntities)
+    auto &batch = *mapState->collisionRayBatch;
+
+    for(uint32_t first = 0; first < batch.count; first += 4)
     {
-        if(outResult.entityExclusionSet.includes(entity))
-            continue;
+        CollisionRayPacket packet;
+        packet.originX = _mm_load_ps(batch.originX + first);
+        packet.originY = _mm_load_ps(batch.originY + first);
+        packet.inverseDirectionX = _mm_load_ps(batch.inverseDirectionX + first);
+        packet.inverseDirectionY = _mm_load_ps(batch.inverseDirectionY + first);
+        packet.minT = _mm_load_ps(batch.minT + first);
+        packet.maxT = _mm_load_ps(batch.maxT + first);
+        packet.halfExtentX = _mm_load_ps(batch.halfExtentX + first);
+        packet.halfExtentY = _mm_load_ps(batch.halfExtentY + first);
+        packet.sweptMinX = _mm_load_ps(batch.sweptMinX + first);
+        packet.sweptMinY = _mm_load_ps(batch.sweptMinY + first);
+        packet.sweptMaxX = _mm_load_ps(batch.sweptMaxX + first);
+        packet.sweptMaxY = _mm_load_ps(batch.sweptMaxY + first);
+        packet.hasCollision = _mm_setzero_ps();
+        packet.collisionDistance = _mm_set1_ps(INFINITY);
+        packet.colliderIndex = _mm_setzero_si128();
+        packet.layerIndex = _mm_setzero_si128();
+
+        // The lanes past the end of the batch are inactive.
+        auto laneCount = std::min(4u, batch.count - first);
+        auto activeLanes = _mm_castsi128_ps(_mm_cmplt_epi32(_mm_set_epi32(3, 2, 1, 0), _mm_set1_epi32(laneCount)));
+        COUNT_COLLISION_QUERY(SweptBox, calls, laneCount);
+
+        int32_t layerIndex = 0;
+        for(auto layer : mapState->layers)
+        {
+            auto solidLayer = reinterpret_cast<MapSolidLayerState*> (layer);
+            if(layer->type == MapLayerType::Solid && solidLayer->mapTileLayer->isSolid())
+            {
+                // The lanes that stay away from the solid tiles skip the traversal.
+                alignas(16) int32_t isClear[4] = {};
+                for(uint32_t lane = 0; lane < laneCount; ++lane)
+                    isClear[lane] = isSweptBoxClearOfSolidLayer(batch.halfExtents[first + lane], batch.rays[first + lane], solidLayer) ? -1 : 0;
 
-        auto testBox = entity->boundingBox().grownWithHalfExtent(boxHalfExtent);
-        auto intersectionResult = testBox.intersectionWithRay(ray);
-        if(intersectionResult.first && (!outResult.hasCollision || intersectionResult.second < outResult.collisionDistance))
+                auto layerLanes = _mm_andnot_ps(_mm_castsi128_ps(_mm_load_si128(reinterpret_cast<__m128i*> (isClear))), activeLanes);
+                if(_mm_movemask_ps(layerLanes))
+                    sweepRayPacketWithSolidLayer(packet, layerLanes, solidLayer, layerIndex);
+            }
+            ++layerIndex;
+        }
+
+        alignas(16) float collisionDistances[4];
+        alignas(16) int32_t colliderIndices[4];
+        alignas(16) int32_t layerIndices[4];
+        _mm_store_ps(collisionDistances, packet.collisionDistance);
+        _mm_store_si128(reinterpret_cast<__m128i*> (colliderIndices), packet.colliderIndex);
+        _mm_store_si128(reinterpret_cast<__m128i*> (layerIndices), packet.layerIndex);
+        auto hasCollisionMask = _mm_movemask_ps(packet.hasCollision);
+        COUNT_COLLISION_QUERY(SweptBox, hits, countActiveLanes(hasCollisionMask));
+        for(uint32_t lane = 0; lane < laneCount; ++lane)
         {
-            outResult.hasCollision = true;
-            outResult.collisionDistance = intersectionResult.second;
-            outResult.collidingBox = testBox;
-            outResult.collidingEntity = entity;
+            if(!(hasCollisionMask & (1 << lane)))
+                continue;
+
+            auto solidLayer = reinterpret_cast<MapSolidLayerState*> (mapState->layers[layerIndices[lane]]);
+            auto &result = batch.worldResults[first + lane];
+            result.hasCollision = true;
+            result.collisionDistance = collisionDistances[lane];
+            result.collidingBox = solidLayer->colliders[colliderIndices[lane]].grownWithHalfExtent(batch.halfExtents[first + lane]);
         }
     }
 }
 
-void sweepCollisionBoxAlongRay(const Vector2F &boxHalfExtent, const Ray2F &ray, CollisionSweepTestResult &outResult)
+#else
+
+void sweepCollisionRayBatchWithWorld()
+{
+    auto &batch = *global.mapTransientState->collisionRayBatch;
+    for(uint32_t i = 0; i < batch.count; ++i)
+        sweepCollisionBoxAlongRayWithWorld(batch.halfExtents[i], batch.rays[i], CollisionQuery(), batch.worldResults[i]);
+}
+
+#endif
+
+void sweepBatchedCollisionBoxAlongRay(uint32_t batchedRayIndex, const Vector2F &boxHalfExtent, const Ray2F &ray, const CollisionQuery &query, CollisionSweepTestResult &outResult)
 {
-    sweepCollisionBoxAlongRayWithWorld(boxHalfExtent, ray, outResult);
-    sweepCollisionBoxAlongRayWithCollidingEntities(boxHalfExtent, ray, outResult);
+    // The batched result is only used for the same ray, bit by bit.
+    auto &batch = *global.mapTransientState->collisionRayBatch;
+    if(batchedRayIndex >= batch.count || !query.includesWorld() ||
+        memcmp(&batch.rays[batchedRayIndex], &ray, sizeof(Ray2F)) != 0 ||
+        memcmp(&batch.halfExtents[batchedRayIndex], &boxHalfExtent, sizeof(Vector2F)) != 0)
+    {
+        sweepCollisionBoxAlongRay(boxHalfExtent, ray, query, outResult);
+        return;
+    }
+
+    // It is the closest hit along the whole ray, so it also answers the first hit
+    // queries, and the queries with a shorter maximum distance.
+    outResult = batch.worldResults[batchedRayIndex];
+    if(outResult.hasCollision && outResult.collisionDistance > query.maxDistance)
+        outResult = CollisionSweepTestResult();
+    if(outResult.hasCollision && query.stopsAtFirstHit())
+        return;
+
+    sweepCollisionBoxAlongRayWithCollidingEntities(boxHalfExtent, ray, query, outResult);
 }
@@ -3,33 +3,187 @@
 
 #include "Box2.hpp"
 #include "FixedVector.hpp"
-#include <unordered_set>
+#include "MapTransientState.hpp"
 #define CollisionNotStuckEpsilon 0.0001f
 #define CollisionSweepStopEpsilon 0.0001f
+#define CollisionGridQueryMargin 0.01f
+#define SolidDistanceSweepMargin (1.0f/64.0f)
+#define CollisionTraversalFootprintMargin 0.01f
+#define CollisionTraversalStopEpsilon 0.01f
 
-class Entity;
+// The sweeps up to this length walk the tiles along the ray instead of the collider hierarchy.
+#define CollisionTraversalMaxSweepLength 2.0f
+
+// The solid tiles are shrunk by the margin when casting the shadows of a target,
+// and the tested tiles are grown by half of it.
+#define TargetShadowOccluderMargin (1.0f/64.0f)
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define USE_SSE2_COLLISION_RAY_BATCH
+#define USE_SSE2_COLLISION_GRID_KERNELS
+#endif
+
+enum {
+    MaxNumberOfCollisionQueryExclusions = 8,
+    MaxNumberOfBatchedCollisionRays = 2048,
+    NoBatchedCollisionRay = 0xffffffff,
+    MaxNumberOfSolidDistanceSweepSteps = 16,
+};
+
+namespace CollisionQueryFilter
+{
+    enum Flags
+    {
+        None,
+        World = 1,
+        Entities = 2,
+        All = World | Entities,
+    };
+};
+
+enum class CollisionQueryMode : uint8_t {
+    // Report the hit with the smallest distance.
+    ClosestHit,
+
+    // Stop at the first hit found, which may not be the closest one.
+    FirstHit,
+};
+
+// The parameters of a collision test. It lives in the stack, and does not allocate.
+struct CollisionQuery
+{
+    CollisionQuery()
+        : maxDistance(INFINITY), categoryMask(CollisionCategory::All), filter(CollisionQueryFilter::All), mode(CollisionQueryMode::ClosestHit) {}
+
+    static CollisionQuery excluding(Entity *entity)
+    {
+        CollisionQuery result;
+        result.exclusionSet.push_back(entity);
+        return result;
+    }
+
+    // A query done by the entity, which only sees the categories in its mask.
+    static CollisionQuery forEntity(Entity *entity)
+    {
+        auto result = excluding(entity);
+        result.categoryMask = entity->collisionMask;
+        return result;
+    }
+
+    bool acceptsCategory(uint16_t category) const
+    {
+        return (category & categoryMask) != 0;
+    }
+
+    bool excludes(Entity *entity) const
+    {
+        return exclusionSet.includes(entity);
+    }
+
+    bool includesWorld() const
+    {
+        return (filter & CollisionQueryFilter::World) != 0;
+    }
+
+    bool includesEntities() const
+    {
+        return (filter & CollisionQueryFilter::Entities) != 0;
+    }
+
+    bool stopsAtFirstHit() const
+    {
+        return mode == CollisionQueryMode::FirstHit;
+    }
+
+    FixedVector<Entity*, MaxNumberOfCollisionQueryExclusions> exclusionSet;
+    float maxDistance;
+    uint16_t categoryMask;
+    uint8_t filter;
+    CollisionQueryMode mode;
+};
 
 struct CollisionSweepTestResult
 {
     CollisionSweepTestResult()
-        : collisionDistance(INFINITY), hasCollision(false) {};
+        : collisionDistance(INFINITY), hasCollision(false), collidingEntity(nullptr) {};
 
     float collisionDistance;
     bool hasCollision;
     Box2F collidingBox;
     Entity *collidingEntity;
-
-    FixedVector<Entity*, 10> entityExclusionSet;
 };
 
+// Collision grid maintenance.
+void initializeCollisionGrid(const Vector2F &mapExtent);
+void insertEntityIntoCollisionGrid(Entity *entity);
+void updateEntityInCollisionGrid(Entity *entity);
+void removeEntityFromCollisionGrid(Entity *entity);
+
+// Merges the solid tiles into rectangles, and builds their bounding volume hierarchy.
+void buildSolidLayerColliders(MapSolidLayerState *solidLayer);
+
+// Computes the distance to the closest solid tile of every tile, from the occupancy bitmap.
+void buildSolidLayerDistanceField(MapSolidLayerState *solidLayer);
+
+// Classifies the blocks of tiles as empty, full or mixed, for any tile layer.
+void buildSolidLayerBlockOccupancy(MapSolidLayerState *solidLayer);
+
+// The sight tests towards a target position that will be done in this tick.
+void addSightTestTowardsTarget(const Vector2F &targetPosition);
+
+// Whether every segment between the target position and the point crosses a solid
+// tile of the first solid layer. This may miss some hidden points, but never
+// reports a visible one. The shadows of each target position are computed once.
+bool isPointInShadowOfTarget(const Vector2F &targetPosition, const Vector2F &point);
+
+// The collision entities of the categories in the mask whose cells overlap the box,
+// in the order of the collision entities list.
+void collectCollisionEntitiesInBox(const Box2F &box, uint16_t categoryMask, CollisionEntityList &outEntities);
+
+// Finds the overlaps of the sensors with a sweep and prune along x, and sends
+// the begin, stay and end contact events.
+void updateSensorContacts();
+
 // Collision testing.
 bool isBoxCollidingWithWorld(const Box2F &box);
-bool isBoxCollidingWithSolid(const Box2F &box);
-bool isBoxCollidingWithSolid(const Box2F &box, const std::unordered_set<Entity*> &exclusionSet);
+bool isBoxCollidingWithSolidEntity(const Box2F &box, const CollisionQuery &query);
+bool isBoxCollidingWithSolid(const Box2F &box, const CollisionQuery &query = CollisionQuery());
+
+void sweepCollisionBoxAlongRayWithWorld(const Vector2F &boxHalfExtent, const Ray2F &ray, const CollisionQuery &query, CollisionSweepTestResult &outResult);
+void sweepCollisionBoxAlongRayWithCollidingEntities(const Vector2F &boxHalfExtent, const Ray2F &ray, const CollisionQuery &query, CollisionSweepTestResult &outResult);
+
+void sweepCollisionBoxAlongRay(const Vector2F &boxHalfExtent, const Ray2F &ray, const CollisionQuery &query, CollisionSweepTestResult &outResult);
+
+// The rays are stored as structures of arrays, so that four of them are loaded at once.
+struct CollisionRayBatch
+{
+    uint32_t count;
+    Ray2F rays[MaxNumberOfBatchedCollisionRays];
+    Vector2F halfExtents[MaxNumberOfBatchedCollisionRays];
+    CollisionSweepTestResult worldResults[MaxNumberOfBatchedCollisionRays];
+
+    alignas(16) float originX[MaxNumberOfBatchedCollisionRays];
+    alignas(16) float originY[MaxNumberOfBatchedCollisionRays];
+    alignas(16) float inverseDirectionX[MaxNumberOfBatchedCollisionRays];
+    alignas(16) float inverseDirectionY[MaxNumberOfBatchedCollisionRays];
+    alignas(16) float minT[MaxNumberOfBatchedCollisionRays];
+    alignas(16) float maxT[MaxNumberOfBatchedCollisionRays];
+    alignas(16) float halfExtentX[MaxNumberOfBatchedCollisionRays];
+    alignas(16) float halfExtentY[MaxNumberOfBatchedCollisionRays];
+    alignas(16) float sweptMinX[MaxNumberOfBatchedCollisionRays];
+    alignas(16) float sweptMinY[MaxNumberOfBatchedCollisionRays];
+    alignas(16) float sweptMaxX[MaxNumberOfBatchedCollisionRays];
+    alignas(16) float sweptMaxY[MaxNumberOfBatchedCollisionRays];
+};
 
-void sweepCollisionBoxAlongRayWithWorld(const Vector2F &boxHalfExtent, const Ray2F &ray, CollisionSweepTestResult &outResult);
-void sweepCollisionBoxAlongRayWithCollidingEntities(const Vector2F &boxHalfExtent, const Ray2F &ray, CollisionSweepTestResult &outResult);
+// The rays of a tick are swept against the static world together, four at a time,
+// before the entities are updated. The entities are still tested when the ray is used.
+// Only the rays longer than a traversal are batched, the shorter ones walk the tiles.
+void beginCollisionRayBatch();
+uint32_t addRayToCollisionRayBatch(const Vector2F &boxHalfExtent, const Ray2F &ray, const CollisionQuery &query);
+void sweepCollisionRayBatchWithWorld();
 
-void sweepCollisionBoxAlongRay(const Vector2F &boxHalfExtent, const Ray2F &ray, CollisionSweepTestResult &outResult);
+// Same as sweepCollisionBoxAlongRay, but it reuses the batched world sweep when the ray did not change.
+void sweepBatchedCollisionBoxAlongRay(uint32_t batchedRayIndex, const Vector2F &boxHalfExtent, const Ray2F &ray, const CollisionQuery &query, CollisionSweepTestResult &outResult);
 
 #endif //COLLISIONS_HPP
@@ -2,6 +2,7 @@
 #define ENTITY_HPP
 
 #include "Box2.hpp"
+#include "Coordinates.hpp"
 #include "FixedString.hpp"
 #include "TileSet.hpp"
 #include <stdint.h>
@@ -14,6 +15,52 @@ enum class EntityBehaviorType : uint8_t {
 
 #define HumanFallTerminalVelocity 53.0f
 
+// The entities placed above the floor are not dropped from farther than this.
+#define EntityMaxFloorDropDistance 100.0f
+
+enum {
+    NumberOfEntityBehaviorTypes = 0
+#   define ENTITY_BEHAVIOR_TYPE(typeName) + 1
+#   include "EntityBehaviorTypes.inc"
+#   undef ENTITY_BEHAVIOR_TYPE
+    ,
+
+    // The line of sight rays towards the VIP and the player.
+    MaxNumberOfBatchedCollisionRaysPerEntity = 2,
+};
+
+// The collision categories of an entity. The queries of an entity only consider
+// the entities whose category is in its collision mask.
+namespace CollisionCategory
+{
+    enum Bits
+    {
+        None = 0,
+        Player = 1<<0,
+        VIP = 1<<1,
+        Enemy = 1<<2,
+        Bullet = 1<<3,
+        Sensor = 1<<4,
+        Item = 1<<5,
+
+        Characters = Player | VIP | Enemy,
+        All = 0xffff,
+    };
+};
+
+// The sides where the last kinematic sweep of an entity was stopped.
+namespace EntityContact
+{
+    enum Bits
+    {
+        None = 0,
+        Ground = 1<<0,
+        Ceiling = 1<<1,
+        WallLeft = 1<<2,
+        WallRight = 1<<3,
+    };
+};
+
 class Renderer;
 struct MapEntityLayerState;
 
@@ -36,6 +83,13 @@ public:
 
     // Size and collisions
     Vector2F halfExtent;
+    Box2I collisionGridCells;
+    uint32_t collisionSequenceNumber; // The order in the collision entities list. Zero when not there.
+    uint32_t collisionQueryStamp;
+    bool isInCollisionGridOverflow;
+    uint16_t collisionCategory;
+    uint16_t collisionMask;
+    uint32_t batchedCollisionRays[MaxNumberOfBatchedCollisionRaysPerEntity]; // Indices in the collision ray batch of the tick.
 
     // Mechanical attributes
     Vector2F position;
@@ -46,6 +100,14 @@ public:
     float inverseMass;
     float coefficientOfRestitution;
 
+    // A resting entity skips the kinematic update, until its inputs change or it is disturbed.
+    bool isSleeping;
+    Vector2F sleepingVelocity;
+    Vector2F sleepingAcceleration;
+
+    // The contacts found by the last kinematic update.
+    uint8_t contacts;
+
     // Specifics attributes.
     Vector2F lookDirection;
     Vector2F walkDirection;
@@ -69,9 +131,13 @@ public:
 
     void applyImpulse(const Vector2F &impulse)
     {
+        wakeUp();
         velocity += impulse*inverseMass;
     }
 
+    void fallAsleep();
+    void wakeUp();
+
     void setMass(float newMass)
     {
         mass = newMass;
@@ -83,6 +149,15 @@ public:
         return Box2F::withCenterAndHalfExtent(position, halfExtent);
     }
 
+    // The area covered by the sprite and the weapon, for culling.
+    Box2F visualBoundingBox()
+    {
+        auto result = boundingBox();
+        if(spriteSheet)
+            result = result.unionWithBox(Box2F::withCenterAndHalfExtent(position + spriteOffset, spriteSheet->tileExtent.asVector2F()*(UnitsPerPixel*0.5f)));
+        return result.grownWithHalfExtent(1.0f);
+    }
+
     void setExtent(const Vector2F &v)
     {
         halfExtent = v/2;
@@ -122,15 +197,20 @@ public:
     }
 
     void spawn();
+    void addCollisionRaysToBatch(float delta);
     void update(float delta);
     void renderWith(Renderer &renderer);
     void hurtAt(float damage, const Vector2F &hitPoint, const Vector2F &hitImpulse);
+    void beginContact(Entity *other);
+    void stayContact(Entity *other);
+    void endContact(Entity *other);
     void dropToFloor();
 
     bool needsTicking();
     bool isSensor();
     bool isPlayer();
     bool isVIP();
+    bool isEnemy();
 };
 
 class EntityBehavior
@@ -141,6 +221,13 @@ public:
         self->color = 0xff0000ff;
     }
 
+    // Adds the rays that the next update sweeps against the world into the batch of the tick.
+    virtual void addCollisionRaysToBatch(Entity *self, float delta)
+    {
+        (void)self;
+        (void)delta;
+    }
+
     virtual void update(Entity *self, float delta)
     {
         (void)self;
@@ -149,6 +236,25 @@ public:
 
     virtual void renderWith(Entity *self, Renderer &renderer);
 
+    // The contact events of a sensor with the entities in its collision mask.
+    virtual void beginContact(Entity *self, Entity *other)
+    {
+        (void)self;
+        (void)other;
+    }
+
+    virtual void stayContact(Entity *self, Entity *other)
+    {
+        (void)self;
+        (void)other;
+    }
+
+    virtual void endContact(Entity *self, Entity *other)
+    {
+        (void)self;
+        (void)other;
+    }
+
     virtual bool needsTicking(Entity *self)
     {
         (void)self;
@@ -161,6 +267,18 @@ public:
         return false;
     }
 
+    virtual uint16_t collisionCategory(Entity *self)
+    {
+        (void)self;
+        return CollisionCategory::None;
+    }
+
+    virtual uint16_t collisionMask(Entity *self)
+    {
+        (void)self;
+        return CollisionCategory::All;
+    }
+
     virtual void hurtAt(Entity *self, float damage, const Vector2F &hitPoint, const Vector2F &hitImpulse)
     {
         (void)self;
@@ -179,6 +297,11 @@ public:
         return false;
     }
 
+    virtual bool isEnemy()
+    {
+        return false;
+    }
+
     virtual bool isSensor()
     {
         return false;
@@ -197,6 +320,11 @@ inline bool Entity::needsTicking()
     return entityBehaviorTypeIntoClass(type)->needsTicking(this);
 }
 
+inline void Entity::addCollisionRaysToBatch(float delta)
+{
+    entityBehaviorTypeIntoClass(type)->addCollisionRaysToBatch(this, delta);
+}
+
 inline void Entity::update(float delta)
 {
     entityBehaviorTypeIntoClass(type)->update(this, delta);
@@ -209,9 +337,25 @@ inline void Entity::renderWith(Renderer &renderer)
 
 inline void Entity::hurtAt(float damage, const Vector2F &hitPoint, const Vector2F &hitImpulse)
 {
+    wakeUp();
     entityBehaviorTypeIntoClass(type)->hurtAt(this, damage, hitPoint, hitImpulse);
 }
 
+inline void Entity::beginContact(Entity *other)
+{
+    entityBehaviorTypeIntoClass(type)->beginContact(this, other);
+}
+
+inline void Entity::stayContact(Entity *other)
+{
+    entityBehaviorTypeIntoClass(type)->stayContact(this, other);
+}
+
+inline void Entity::endContact(Entity *other)
+{
+    entityBehaviorTypeIntoClass(type)->endContact(this, other);
+}
+
 inline bool Entity::isPlayer()
 {
     return entityBehaviorTypeIntoClass(type)->isPlayer();
@@ -222,6 +366,11 @@ inline bool Entity::isVIP()
     return entityBehaviorTypeIntoClass(type)->isVIP();
 }
 
+inline bool Entity::isEnemy()
+{
+    return entityBehaviorTypeIntoClass(type)->isEnemy();
+}
+
 inline bool Entity::isSensor()
 {
     return entityBehaviorTypeIntoClass(type)->isSensor();
@@ -235,7 +384,7 @@ public:
 class EntityKinematicCollidingBehavior : public EntityBehavior
 {
 public:
-    void sweepCollidingAlongSegment(Entity *self, const Vector2F &segmentStartPoint, const Vector2F &segmentEndPoint, uint32_t maxDepth=5);
+    void sweepCollidingAlongSegment(Entity *self, const Vector2F &segmentStartPoint, const Vector2F &segmentEndPoint, bool &outHasTouchedEntity, uint32_t maxDepth=5);
 
     virtual Vector2F myGravity()
     {
@@ -280,6 +429,18 @@ public:
     virtual void spawn(Entity *self) override;
     virtual void update(Entity *self, float delta) override;
 
+    virtual uint16_t collisionCategory(Entity *self) override
+    {
+        (void)self;
+        return CollisionCategory::Bullet;
+    }
+
+    virtual uint16_t collisionMask(Entity *self) override
+    {
+        (void)self;
+        return CollisionCategory::Characters;
+    }
+
     virtual bool needsTicking(Entity *self) override
     {
         (void)self;
@@ -302,6 +463,16 @@ public:
         return true;
     }
 
+    virtual uint16_t collisionCategory(Entity *self) override
+    {
+        (void)self;
+        if(isPlayer())
+            return CollisionCategory::Player;
+        if(isVIP())
+            return CollisionCategory::VIP;
+        return CollisionCategory::Enemy;
+    }
+
     virtual float maximumJumpHeight()
     {
         return 7.0f;
@@ -423,6 +594,7 @@ public:
     typedef EntityCharacterBehavior Super;
 
     virtual void spawn(Entity *self) override;
+    virtual void addCollisionRaysToBatch(Entity *self, float delta) override;
     virtual float maximumTargetSightDistance(Entity *self)
     {
         (void)self;
@@ -434,7 +606,13 @@ public:
         return true;
     }
 
-    bool hasTargetOnSight(Entity *self, Entity *testTarget);
+    virtual bool isEnemy() override
+    {
+        return true;
+    }
+
+    bool lineOfSightRayTo(Entity *self, Entity *testTarget, Ray2F &outRay);
+    bool hasTargetOnSight(Entity *self, Entity *testTarget, uint32_t batchedRayIndex);
     bool hasSomeTargetOnSight(Entity *self);
 };
 
@@ -639,20 +817,22 @@ class EntitySensorBehavior : public EntityBehavior
 public:
     typedef EntityBehavior Super;
 
-    virtual void touches(Entity *self, Entity *touched)
+    virtual bool isSensor() override
     {
-        (void)self;
-        (void)touched;
+        return true;
     }
 
-    virtual void update(Entity *self, float delta) override;
-
-    virtual bool needsTicking(Entity *self)
+    virtual uint16_t collisionCategory(Entity *self) override
     {
         (void)self;
-        return true;
+        return CollisionCategory::Sensor;
     }
 
+    virtual uint16_t collisionMask(Entity *self) override
+    {
+        (void)self;
+        return CollisionCategory::Characters;
+    }
 };
 
 class EntityInvisibleSensorBehavior : public EntitySensorBehavior
@@ -669,7 +849,13 @@ class EntityGoalSensorBehavior : public EntityInvisibleSensorBehavior
 public:
     typedef EntityInvisibleSensorBehavior Super;
 
-    virtual void touches(Entity *self, Entity *touched) override;
+    virtual uint16_t collisionMask(Entity *self) override
+    {
+        (void)self;
+        return CollisionCategory::VIP;
+    }
+
+    virtual void beginContact(Entity *self, Entity *other) override;
 };
 
 class EntityItemBehavior : public EntitySensorBehavior
@@ -677,6 +863,18 @@ class EntityItemBehavior : public EntitySensorBehavior
 public:
     typedef EntitySensorBehavior Super;
 
+    virtual uint16_t collisionCategory(Entity *self) override
+    {
+        (void)self;
+        return CollisionCategory::Item;
+    }
+
+    virtual uint16_t collisionMask(Entity *self) override
+    {
+        (void)self;
+        return CollisionCategory::Player | CollisionCategory::VIP;
+    }
+
     void dropToFloor(Entity *self);
 };
 
@@ -687,7 +885,7 @@ public:
 
     virtual void spawn(Entity *self) override;
 
-    virtual void touches(Entity *self, Entity *touched) override;
+    virtual void beginContact(Entity *self, Entity *other) override;
 };
 
 Entity *instatiateEntityInLayer(MapEntityLayerState *entityLayer, EntityBehaviorType type);
@@ -21,25 +21,56 @@ EntityBehavior *entityBehaviorTypeIntoClass(EntityBehaviorType type)
 void Entity::spawn()
 {
     auto selfClass = entityBehaviorTypeIntoClass(type);
+    // The categories are needed by the queries done while spawning, such as dropToFloor.
+    collisionCategory = selfClass->collisionCategory(this);
+    collisionMask = selfClass->collisionMask(this);
     selfClass->spawn(this);
     if(selfClass->needsTicking(this))
         global.mapTransientState->tickingEntitites.push_back(this);
     if(selfClass->hasCollisions(this))
+    {
         global.mapTransientState->collisionEntities.push_back(this);
+        insertEntityIntoCollisionGrid(this);
+    }
+    if(selfClass->isSensor() || selfClass->hasCollisions(this))
+        global.mapTransientState->sensorContactEntities.push_back(this);
+}
+
+void Entity::fallAsleep()
+{
+    isSleeping = true;
+    sleepingVelocity = velocity;
+    sleepingAcceleration = acceleration;
+    ++global.mapTransientState->sleepStatistics.sleepCount;
+}
+
+void Entity::wakeUp()
+{
+    if(!isSleeping)
+        return;
+
+    isSleeping = false;
+    ++global.mapTransientState->sleepStatistics.wakeCount;
 }
 
 void Entity::dropToFloor()
 {
-    auto floorRay = Ray2F(position, Vector2F(0.0f, -1.0f), 0.0f, 100.0f);
+    // The ray goes down to the bottom of the map, and the query stops it at the maximum drop.
+    auto floorRay = Ray2F(position, Vector2F(0.0f, -1.0f), 0.0f, std::max(position.y, 0.0f));
+    auto floorQuery = CollisionQuery::forEntity(this);
+    floorQuery.maxDistance = EntityMaxFloorDropDistance;
 
     CollisionSweepTestResult collisionTestResult;
-    collisionTestResult.entityExclusionSet.push_back(this);
 
     // No collision, nothing interesting is required.
-    sweepCollisionBoxAlongRay(halfExtent, floorRay, collisionTestResult);
+    sweepCollisionBoxAlongRay(halfExtent, floorRay, floorQuery, collisionTestResult);
 
     if(collisionTestResult.hasCollision)
+    {
         position = floorRay.pointAtT(collisionTestResult.collisionDistance);
+        contacts = EntityContact::Ground;
+        updateEntityInCollisionGrid(this);
+    }
 }
 
 //============================================================================
@@ -57,13 +88,13 @@ void EntityBulletBehavior::update(Entity *self, float delta)
     auto newPosition = self->position + self->velocity*delta;
 
     auto collisionRay = Ray2F::fromSegment(oldPosition, newPosition);
-    CollisionSweepTestResult collisionTestResult;
-    collisionTestResult.entityExclusionSet.push_back(self);
+    auto collisionQuery = CollisionQuery::forEntity(self);
     if(self->owner)
-        collisionTestResult.entityExclusionSet.push_back(self->owner);
+        collisionQuery.exclusionSet.push_back(self->owner);
 
     // No collision, nothing interesting is required.
-    sweepCollisionBoxAlongRay(self->halfExtent, collisionRay, collisionTestResult);
+    CollisionSweepTestResult collisionTestResult;
+    sweepCollisionBoxAlongRay(self->halfExtent, collisionRay, collisionQuery, collisionTestResult);
     if(collisionTestResult.hasCollision)
     {
         if(collisionTestResult.collidingEntity)
@@ -88,17 +119,16 @@ void EntityBulletBehavior::update(Entity *self, float delta)
 // EntityKinematicCollidingBehavior
 //============================================================================
 
-void EntityKinematicCollidingBehavior::sweepCollidingAlongSegment(Entity *self, const Vector2F &segmentStartPoint, const Vector2F &segmentEndPoint, uint32_t maxDepth)
+void EntityKinematicCollidingBehavior::sweepCollidingAlongSegment(Entity *self, const Vector2F &segmentStartPoint, const Vector2F &segmentEndPoint, bool &outHasTouchedEntity, uint32_t maxDepth)
 {
     if(maxDepth == 0)
         return;
 
     auto collisionRay = Ray2F::fromSegment(segmentStartPoint, segmentEndPoint);
     CollisionSweepTestResult collisionTestResult;
-    collisionTestResult.entityExclusionSet.push_back(self);
 
     // No collision, nothing interesting is required.
-    sweepCollisionBoxAlongRay(self->halfExtent, collisionRay, collisionTestResult);
+    sweepCollisionBoxAlongRay(self->halfExtent, collisionRay, CollisionQuery::forEntity(self), collisionTestResult);
     if(!collisionTestResult.hasCollision)
     {
         self->position = segmentEndPoint;
@@ -110,8 +140,19 @@ void EntityKinematicCollidingBehavior::sweepCollidingAlongSegment(Entity *self,
     auto collisionNormal = collisionNormalAndPenetration.first;
     auto penetrationDistance = collisionNormalAndPenetration.second;
 
+    // The normals are axis aligned.
+    if(collisionNormal.y > 0.0f)
+        self->contacts |= EntityContact::Ground;
+    else if(collisionNormal.y < 0.0f)
+        self->contacts |= EntityContact::Ceiling;
+    else if(collisionNormal.x > 0.0f)
+        self->contacts |= EntityContact::WallLeft;
+    else if(collisionNormal.x < 0.0f)
+        self->contacts |= EntityContact::WallRight;
+
     if(collisionTestResult.collidingEntity)
     {
+        outHasTouchedEntity = true;
         collisionTestResult.collidingEntity->applyImpulse(self->velocity*self->mass*collisionNormal.abs()*self->coefficientOfRestitution);
     }
 
@@ -139,17 +180,41 @@ void EntityKinematicCollidingBehavior::sweepCollidingAlongSegment(Entity *self,
 
     auto tangentDirection = collisionRay.direction*tangentMask;
     auto nextSegmentEnd = self->position + tangentDirection*remainingT;
-    sweepCollidingAlongSegment(self, self->position, nextSegmentEnd, maxDepth - 1);
+    sweepCollidingAlongSegment(self, self->position, nextSegmentEnd, outHasTouchedEntity, maxDepth - 1);
+}
+
+static bool isSameVector(const Vector2F &a, const Vector2F &b)
+{
+    return a.x == b.x && a.y == b.y;
 }
 
 void EntityKinematicCollidingBehavior::update(Entity *self, float delta)
 {
+    // A sleeping entity keeps resting while its inputs do not change.
+    if(self->isSleeping)
+    {
+        if(isSameVector(self->velocity, self->sleepingVelocity) && isSameVector(self->acceleration, self->sleepingAcceleration))
+            return;
+        self->wakeUp();
+    }
+
+    auto oldPosition = self->position;
+    auto oldVelocity = self->velocity;
+
     // Euler method.
     auto acceleration = self->acceleration - self->damping*self->velocity;
     self->velocity += acceleration*delta;
     auto newPosition = self->position + self->velocity*delta;
 
-    sweepCollidingAlongSegment(self, self->position, newPosition);
+    bool hasTouchedEntity = false;
+    self->contacts = EntityContact::None;
+    sweepCollidingAlongSegment(self, self->position, newPosition, hasTouchedEntity);
+    updateEntityInCollisionGrid(self);
+
+    // An update that did not change anything would repeat itself, unless the
+    // entity rests on another entity, which may move away without notice.
+    if(!hasTouchedEntity && isSameVector(self->position, oldPosition) && isSameVector(self->velocity, oldVelocity))
+        self->fallAsleep();
 }
 
 //============================================================================
@@ -211,10 +276,7 @@ void EntityCharacterBehavior::update(Entity *self, float delta)
 
 bool EntityCharacterBehavior::isOnFloor(Entity *self)
 {
-    auto floorSensor = Box2F::withCenterAndHalfExtent(self->position, Vector2F(self->halfExtent.x, 0.1f))
-        .translatedBy(Vector2F(0.0f, -self->halfExtent.y - 0.1f));
-    //self->debugSensor = floorSensor;
-    return isBoxCollidingWithSolid(floorSensor, {self});
+    return (self->contacts & EntityContact::Ground) != 0;
 }
 
 bool EntityCharacterBehavior::hasFloorForward(Entity *self)
@@ -227,19 +289,24 @@ bool EntityCharacterBehavior::hasFloorForward(Entity *self)
         .translatedBy(wallSensorPosition);
 
     //self->debugSensor = wallSensor;
-    return isBoxCollidingWithSolid(wallSensor, {self});;
+    return isBoxCollidingWithSolid(wallSensor, CollisionQuery::forEntity(self));
 }
 
 bool EntityCharacterBehavior::hasWallForward(Entity *self)
 {
+    // A wall that stopped the last sweep is known without probing.
+    auto isLookingRight = self->lookDirection.x >= 0;
+    if(self->contacts & (isLookingRight ? EntityContact::WallRight : EntityContact::WallLeft))
+        return true;
+
     auto testGap = forwardTestGap(self);
-    auto wallSensorSign = self->lookDirection.x >= 0 ? 1.0f : -1.0f;
+    auto wallSensorSign = isLookingRight ? 1.0f : -1.0f;
     auto wallSensorPosition = Vector2F((self->halfExtent.x + testGap + 0.1f)*wallSensorSign, 0.0f);
     auto wallSensor = Box2F::withCenterAndHalfExtent(self->position, Vector2F(0.1f, self->halfExtent.y*0.9f))
         .translatedBy(wallSensorPosition);
 
     //self->debugSensor = wallSensor;
-    return isBoxCollidingWithSolid(wallSensor, {self});
+    return isBoxCollidingWithSolid(wallSensor, CollisionQuery::forEntity(self));
 }
 
 bool EntityCharacterBehavior::canJump(Entity *self)
@@ -393,46 +460,94 @@ void EntityPlayerBehavior::update(Entity *self, float delta)
 // EntityEnemyBehavior
 //============================================================================
 
-bool EntityEnemyBehavior::hasTargetOnSight(Entity *self, Entity *testTarget)
+bool EntityEnemyBehavior::lineOfSightRayTo(Entity *self, Entity *testTarget, Ray2F &outRay)
 {
-    auto testRay = Ray2F::fromSegment(self->position, testTarget->position);
+    outRay = Ray2F::fromSegment(self->position, testTarget->position);
 
     // The target cannot be much farther.
-    if(testRay.maxT > maximumTargetSightDistance(self))
+    if(outRay.maxT > maximumTargetSightDistance(self))
         return false;
 
     // Check whether we are looking on the correct direction.
     if(self->lookDirection.y == 0)
     {
-        if(self->lookDirection.x * testRay.direction.x < 0)
+        if(self->lookDirection.x * outRay.direction.x < 0)
             return false;
     }
     else
     {
-        if(self->lookDirection.x * testRay.direction.x < 0)
+        if(self->lookDirection.x * outRay.direction.x < 0)
             return false;
     }
 
-    // Check whether we are looking on the correct direction.
-    CollisionSweepTestResult collisionTestResult;
-    collisionTestResult.entityExclusionSet.push_back(self);
+    return true;
+}
 
-    // No collision, nothing interesting is required.
-    sweepCollisionBoxAlongRay(0.0f, testRay, collisionTestResult);
+// Any wall before the target hides it, so the sight tests stop at the first one.
+static CollisionQuery lineOfSightWorldQuery()
+{
+    CollisionQuery result;
+    result.filter = CollisionQueryFilter::World;
+    result.mode = CollisionQueryMode::FirstHit;
+    return result;
+}
+
+bool EntityEnemyBehavior::hasTargetOnSight(Entity *self, Entity *testTarget, uint32_t batchedRayIndex)
+{
+    Ray2F testRay;
+    if(!lineOfSightRayTo(self, testTarget, testRay))
+        return false;
+
+    // The shadows of the target reject most of the enemies behind the walls without a ray.
+    if(isPointInShadowOfTarget(testTarget->position, self->position))
+        return false;
+
+    // The target must be the closest entity on the segment.
+    CollisionSweepTestResult entityTestResult;
+    auto entityQuery = CollisionQuery::forEntity(self);
+    entityQuery.filter = CollisionQueryFilter::Entities;
+    sweepCollisionBoxAlongRayWithCollidingEntities(0.0f, testRay, entityQuery, entityTestResult);
+    if(!entityTestResult.hasCollision || entityTestResult.collidingEntity != testTarget)
+        return false;
 
-    return collisionTestResult.hasCollision && collisionTestResult.collidingEntity == testTarget;
+    // A wall at the same distance as the target also hides it.
+    auto worldQuery = lineOfSightWorldQuery();
+    worldQuery.maxDistance = entityTestResult.collisionDistance;
+    CollisionSweepTestResult worldTestResult;
+    sweepBatchedCollisionBoxAlongRay(batchedRayIndex, 0.0f, testRay, worldQuery, worldTestResult);
+    return !worldTestResult.hasCollision;
 }
 
 bool EntityEnemyBehavior::hasSomeTargetOnSight(Entity *self)
 {
     auto transientState = global.mapTransientState;
-    if(transientState->activeVIP && hasTargetOnSight(self, transientState->activeVIP))
+    if(transientState->activeVIP && hasTargetOnSight(self, transientState->activeVIP, self->batchedCollisionRays[0]))
         return true;
-    if(transientState->activePlayer && hasTargetOnSight(self, transientState->activePlayer))
+    if(transientState->activePlayer && hasTargetOnSight(self, transientState->activePlayer, self->batchedCollisionRays[1]))
         return true;
     return false;
 }
 
+void EntityEnemyBehavior::addCollisionRaysToBatch(Entity *self, float delta)
+{
+    (void)delta;
+    auto transientState = global.mapTransientState;
+    Entity *targets[MaxNumberOfBatchedCollisionRaysPerEntity] = {transientState->activeVIP, transientState->activePlayer};
+    for(int i = 0; i < MaxNumberOfBatchedCollisionRaysPerEntity; ++i)
+    {
+        Ray2F testRay;
+        if(targets[i] && lineOfSightRayTo(self, targets[i], testRay))
+        {
+            addSightTestTowardsTarget(targets[i]->position);
+            self->batchedCollisionRays[i] = addRayToCollisionRayBatch(0.0f, testRay, lineOfSightWorldQuery());
+        }
+        else
+        {
+            self->batchedCollisionRays[i] = NoBatchedCollisionRay;
+        }
+    }
+}
+
 void EntityEnemyBehavior::spawn(Entity *self)
 {
     Super::spawn(self);
@@ -685,32 +800,13 @@ void EntityMrPresidentBehavior::spawn(Entity *self)
     self->dropToFloor();
 }
 
-//============================================================================
-// EntitySensorBehavior
-//============================================================================
-
-void EntitySensorBehavior::update(Entity *self, float delta)
-{
-    Super::update(self, delta);
-
-    auto myBBox = self->boundingBox();
-    for(auto entity : global.mapTransientState->collisionEntities)
-    {
-        if(entity == self || entity->isDead())
-            continue;
-
-        if(entity->boundingBox().intersectsWithBox(myBBox))
-            touches(self, entity);
-    }
-}
-
 //============================================================================
 // EntityGoalSensorBehavior
 //============================================================================
-void EntityGoalSensorBehavior::touches(Entity *self, Entity *touched)
+void EntityGoalSensorBehavior::beginContact(Entity *self, Entity *other)
 {
     (void)self;
-    if(touched->isVIP())
+    if(other->isVIP())
         global.mapTransientState->isGoalReached = true;
 }
 
@@ -730,14 +826,14 @@ void EntityItemMedkitBehavior::spawn(Entity *self)
     self->dropToFloor();
 }
 
-void EntityItemMedkitBehavior::touches(Entity *self, Entity *touched)
+void EntityItemMedkitBehavior::beginContact(Entity *self, Entity *other)
 {
     if(self->isDead())
         return;
 
-    if(touched->isPlayer() || touched->isVIP())
+    if(other->isPlayer() || other->isVIP())
     {
-        touched->hitPoints = std::min((int)touched->maxHitPoints, std::max(int(touched->hitPoints) - self->contactDamage, 0));
+        other->hitPoints = std::min((int)other->maxHitPoints, std::max(int(other->hitPoints) - self->contactDamage, 0));
         self->kill();
         global.healthPickupSample->play(false, 0.5f);
     }
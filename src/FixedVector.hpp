@@ -92,6 +92,18 @@ public:
         size_ = destIndex;
     }
 
+    value_type &operator[](size_t index)
+    {
+        assert(index < size_);
+        return storage()[index];
+    }
+
+    const value_type &operator[](size_t index) const
+    {
+        assert(index < size_);
+        return storage()[index];
+    }
+
     value_type &back()
     {
         return storage()[size_ - 1];
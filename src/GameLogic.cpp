@@ -2,6 +2,7 @@
 #include "HostInterface.hpp"
 #include "GameLogic.hpp"
 #include "MapTransientState.hpp"
+#include "Collisions.hpp"
 #include <algorithm>
 #include <stdio.h>
 #include <time.h>
@@ -84,15 +85,189 @@ static void loadMapFileEntityLayer(const MapFileEntityLayer &layer)
 
 }
 
+struct ParallaxLayerDescription
+{
+    const char *imageFileName;
+    float scrollFactor;
+};
+
+// The background layers of the maps that do not list them in their properties.
+static const ParallaxLayerDescription DefaultParallaxLayers[] = {
+    {"background.png", 0.25f},
+};
+
+static const ParallaxLayerDescription MrPresidentParallaxLayers[] = {
+    {"background.png", 0.15f},
+};
+
+static void loadParallaxLayer(const ParallaxLayerDescription &description)
+{
+    ImagePtr image(hostInterface->loadImage(description.imageFileName));
+    if(!image)
+        return;
+
+    // Cross fade the tail of the image into its head, to hide the seam when wrapping.
+    int32_t blendWidth = image->width / 8;
+    int32_t stripWidth = image->width - blendWidth;
+    int32_t stripHeight = image->height;
+
+    ParallaxLayerState layer;
+    layer.pixels = reinterpret_cast<uint32_t*> (allocateTransientBytes(stripWidth*stripHeight*4));
+    layer.extent = Vector2I(stripWidth, stripHeight);
+    layer.scrollFactor = description.scrollFactor;
+
+    bool hasTransparentPixels = false;
+    bool hasTranslucentPixels = false;
+
+    auto dest = layer.pixels;
+    auto sourceRow = image->data.get();
+    for(int32_t y = 0; y < stripHeight; ++y)
+    {
+        auto source = reinterpret_cast<const uint32_t*> (sourceRow);
+        for(int32_t x = 0; x < stripWidth; ++x)
+        {
+            auto pixel = source[x];
+            if(x < blendWidth)
+            {
+                auto tailPixel = source[stripWidth + x];
+                uint32_t weight = (x*256 + 128) / blendWidth;
+                auto redBlue = ((tailPixel & 0x00ff00ff)*(256 - weight) + (pixel & 0x00ff00ff)*weight) >> 8;
+                auto greenAlpha = ((tailPixel >> 8) & 0x00ff00ff)*(256 - weight) + ((pixel >> 8) & 0x00ff00ff)*weight;
+                pixel = (redBlue & 0x00ff00ff) | (greenAlpha & 0xff00ff00);
+            }
+
+            auto alpha = pixel >> 24;
+            if(alpha == 0)
+                hasTransparentPixels = true;
+            else if(alpha != 0xff)
+                hasTranslucentPixels = true;
+            *dest++ = pixel;
+        }
+
+        sourceRow += image->pitch;
+    }
+
+    if(hasTranslucentPixels)
+        layer.alphaClass = ImageAlphaClass::Translucent;
+    else if(hasTransparentPixels)
+        layer.alphaClass = ImageAlphaClass::BinaryAlpha;
+    else
+        layer.alphaClass = ImageAlphaClass::Opaque;
+
+    global.mapTransientState->parallaxLayers.push_back(layer);
+}
+
+// The map properties parallaxLayer<N>.image and parallaxLayer<N>.scrollFactor list
+// the background layers from back to front. Returns the number of listed layers.
+static size_t loadMapPropertiesParallaxLayers()
+{
+    size_t layerCount = 0;
+    for(; layerCount < MaxNumberOfParallaxLayers; ++layerCount)
+    {
+        char prefix[32];
+        sprintf(prefix, "parallaxLayer%d", int(layerCount));
+        auto imageFileName = global.currentMap->propertyNamed(std::string(prefix) + ".image");
+        if(imageFileName.empty())
+            break;
+
+        auto scrollFactor = global.currentMap->propertyNamed(std::string(prefix) + ".scrollFactor");
+        ParallaxLayerDescription description;
+        description.imageFileName = imageFileName.c_str();
+        description.scrollFactor = scrollFactor.empty() ? 1.0f : float(atof(scrollFactor.c_str()));
+        loadParallaxLayer(description);
+    }
+
+    return layerCount;
+}
+
 static void loadMapFileTileLayer(const MapFileTileLayer &layer)
 {
     auto solidLayer = newTransient<MapSolidLayerState> ();
     solidLayer->mapTileLayer = &layer;
 
+    // The renderer skips the empty blocks of every tile layer.
+    buildSolidLayerBlockOccupancy(solidLayer);
+
+    // Only the solid layers are tested by the collisions.
+    if(layer.isSolid())
+    {
+        // Build the occupancy bitmap used by the collision tests.
+        auto wordsPerRow = (layer.extent.x + 63) / 64;
+        solidLayer->occupancyWordsPerRow = wordsPerRow;
+        solidLayer->occupancy = reinterpret_cast<uint64_t*> (allocateTransientBytes(wordsPerRow*layer.extent.y*sizeof(uint64_t)));
+        auto source = layer.tiles;
+        for(int32_t y = 0; y < layer.extent.y; ++y)
+        {
+            auto row = solidLayer->occupancy + y*wordsPerRow;
+            for(int32_t x = 0; x < layer.extent.x; ++x)
+            {
+                if(*source++ != 0)
+                    row[x >> 6] |= uint64_t(1) << (x & 63);
+            }
+        }
+
+        buildSolidLayerColliders(solidLayer);
+        buildSolidLayerDistanceField(solidLayer);
+    }
+
     global.mapTransientState->layers.push_back(solidLayer);
 }
 
-static void loadMapFile(const char *filename, const char *messageTitle)
+static void buildMinimap()
+{
+    auto &minimap = global.mapTransientState->minimap;
+    minimap.referenceLayer = nullptr;
+    minimap.extent = Vector2I::zeros();
+    global.currentMap->layersDo([&](const MapFileLayer &layer) {
+        if(layer.type != MapFileLayerType::Tiles)
+            return;
+
+        auto &tileLayer = reinterpret_cast<const MapFileTileLayer &> (layer);
+        if(!minimap.referenceLayer)
+            minimap.referenceLayer = &tileLayer;
+        minimap.extent = std::max(minimap.extent, tileLayer.extent);
+    });
+
+    if(!minimap.referenceLayer)
+        return;
+
+    auto texelCount = minimap.extent.x*minimap.extent.y;
+    minimap.texels = reinterpret_cast<uint32_t*> (allocateTransientBytes(texelCount*4));
+    for(int32_t i = 0; i < texelCount; ++i)
+        minimap.texels[i] = MinimapBackgroundColor;
+
+    // Any factor above one fits in a quarter of the texels.
+    auto halfExtent = (minimap.extent + 1) / 2;
+    minimap.downsampledTexels = reinterpret_cast<uint32_t*> (allocateTransientBytes(halfExtent.x*halfExtent.y*4));
+    minimap.downsampledExtent = Vector2I::zeros();
+    minimap.downsampleFactor = 0;
+
+    // Later layers are drawn on top of the previous ones.
+    auto &tileSet = global.mainTileSet;
+    global.currentMap->layersDo([&](const MapFileLayer &layer) {
+        if(layer.type != MapFileLayerType::Tiles)
+            return;
+
+        auto &tileLayer = reinterpret_cast<const MapFileTileLayer &> (layer);
+        auto source = tileLayer.tiles;
+        for(int32_t y = 0; y < tileLayer.extent.y; ++y)
+        {
+            auto dest = minimap.texels + y*minimap.extent.x;
+            for(int32_t x = 0; x < tileLayer.extent.x; ++x)
+            {
+                auto tileIndex = *source++;
+                if(tileIndex == 0 || uint32_t(tileIndex - 1) >= tileSet.tileCount)
+                    continue;
+
+                auto color = tileSet.tileAverageColors[tileIndex - 1];
+                if(color)
+                    dest[x] = color;
+            }
+        }
+    });
+}
+
+static void loadMapFile(const char *filename, const char *messageTitle, const ParallaxLayerDescription *fallbackParallaxLayers, size_t fallbackParallaxLayerCount)
 {
     // Do the actual map loading.
     global.currentMap.reset(hostInterface->loadMapFile(filename));
@@ -102,6 +277,15 @@ static void loadMapFile(const char *filename, const char *messageTitle)
     global.mapTransientState = newTransient<MapTransientState> ();
     global.cameraPosition = Vector2F::zeros();
 
+    // The background layers.
+    if(!loadMapPropertiesParallaxLayers())
+    {
+        for(size_t i = 0; i < fallbackParallaxLayerCount; ++i)
+            loadParallaxLayer(fallbackParallaxLayers[i]);
+    }
+
+    initializeCollisionGrid(global.currentMap->extent().asVector2F()*UnitsPerPixel);
+
     // Clear the map states.
     global.currentMap->layersDo([&](const MapFileLayer &layer) {
         switch(layer.type)
@@ -118,6 +302,8 @@ static void loadMapFile(const char *filename, const char *messageTitle)
         }
     });
 
+    buildMinimap();
+
     // Clear the special layers.
     {
         auto projectileLayer = newTransient<MapEntityLayerState> ();
@@ -130,19 +316,19 @@ static void loadMapFile(const char *filename, const char *messageTitle)
     global.mapTransientState->currentMessageRemainingTime = 3.0f;
 }
 
-static void startNewMap()
+void startNewMap()
 {
     switch(global.currentLevelID)
     {
     case LevelID::DonMeowth:
-        loadMapFile("donMeowth.map", "Escort\nDon Meowth!!!");
+        loadMapFile("donMeowth.map", "Escort\nDon Meowth!!!", DefaultParallaxLayers, sizeof(DefaultParallaxLayers)/sizeof(DefaultParallaxLayers[0]));
         break;
     case LevelID::MrPresident:
-        loadMapFile("mrPresident.map", "Protect\nMr. President!!!");
+        loadMapFile("mrPresident.map", "Protect\nMr. President!!!", MrPresidentParallaxLayers, sizeof(MrPresidentParallaxLayers)/sizeof(MrPresidentParallaxLayers[0]));
         break;
     case LevelID::Test:
     default:
-        loadMapFile("test.map", "Escort the ^!!!");
+        loadMapFile("test.map", "Escort the ^!!!", DefaultParallaxLayers, sizeof(DefaultParallaxLayers)/sizeof(DefaultParallaxLayers[0]));
         break;
     }
 }
@@ -174,7 +360,6 @@ static void initializeGlobalState()
         return;
 
     // This is the place for loading the required game assets
-    global.backgroundImage.reset(hostInterface->loadImage("background.png"));
     global.mainTileSet.loadFrom("tileset.png");
     global.hudTiles.loadFrom("hud.png");
     global.itemsSprites.loadFrom("items.png");
@@ -224,6 +409,20 @@ static void updateTransientState(float delta)
     if(!(transientState->isGameOver || global.isGameFinished) && global.isButtonPressed(ControllerButton::Start))
         global.isPaused = !global.isPaused;
 
+    // Picture in picture view of the VIP.
+    if(global.isButtonPressed(ControllerButton::Select))
+        global.isVipViewportEnabled = !global.isVipViewportEnabled;
+
+    if(global.isButtonPressed(ControllerButton::RightShoulder))
+        global.isMinimapEnabled = !global.isMinimapEnabled;
+
+    if(global.isButtonPressed(ControllerButton::RightStick))
+        global.isCollisionStatisticsOverlayEnabled = !global.isCollisionStatisticsOverlayEnabled;
+
+    // Zoom out the camera by powers of two, for spectating and debugging.
+    if(global.isButtonPressed(ControllerButton::LeftShoulder))
+        global.cameraZoomLevel = (global.cameraZoomLevel + 1) % MaxNumberOfTileSetMipLevels;
+
     if(transientState->isGameOver &&
         transientState->timeInGameOver > 0.5f &&
         global.isButtonPressed(ControllerButton::Start | ControllerButton::A | ControllerButton::X))
@@ -255,12 +454,32 @@ static void updateTransientState(float delta)
 
     // The time of the active message
     transientState->timeInMap += delta;
+    ++transientState->tickCount;
     if(transientState->currentMessageRemainingTime > 0.0f)
         transientState->currentMessageRemainingTime -= delta;
 
+    // Sweep the rays of the tick against the world together.
+    auto &collisionStatistics = transientState->collisionStatistics;
+    beginCollisionRayBatch();
+    for(auto entity : transientState->tickingEntitites)
+    {
+        collisionStatistics.setCurrentCaller(entity);
+        entity->addCollisionRaysToBatch(delta);
+    }
+    collisionStatistics.setCurrentCaller(nullptr);
+    sweepCollisionRayBatchWithWorld();
+
     // Update the ticking entities.
     for(auto entity : transientState->tickingEntitites)
+    {
+        collisionStatistics.setCurrentCaller(entity);
         entity->update(delta);
+    }
+    collisionStatistics.setCurrentCaller(nullptr);
+
+    // Send the contact events to the sensors.
+    updateSensorContacts();
+    collisionStatistics.finishTick();
 
     // Remove all of the dead entities.
     auto areDead = [](Entity *entity){
@@ -274,8 +493,14 @@ static void updateTransientState(float delta)
         auto entityLayer = reinterpret_cast<MapEntityLayerState*> (layer);
         entityLayer->entities.removeAllThat(areDead);
     }
+    for(auto entity : transientState->collisionEntities)
+    {
+        if(entity->isDead())
+            removeEntityFromCollisionGrid(entity);
+    }
     transientState->collisionEntities.removeAllThat(areDead);
     transientState->tickingEntitites.removeAllThat(areDead);
+    transientState->sensorContactEntities.removeAllThat(areDead);
 
     if(transientState->activePlayer && transientState->activePlayer->isDead())
         transientState->activePlayer = nullptr;
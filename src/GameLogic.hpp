@@ -21,11 +21,22 @@ enum class LevelID
     FinalLevel = MrPresident,
 };
 
+// Time spent by the renderer in each pass of the last frame, in milliseconds.
+struct RenderPassTimings
+{
+    double recording;
+    double viewports;
+    double overlays;
+};
+
 struct GlobalState
 {
     // Global states
     bool isInitialized;
     bool isPaused;
+    bool isVipViewportEnabled;
+    bool isMinimapEnabled;
+    bool isCollisionStatisticsOverlayEnabled;
     bool isGameFinished;
     LevelID currentLevelID;
     float currentTime;
@@ -33,7 +44,6 @@ struct GlobalState
     ControllerState controllerState;
 
     // Sprited/tiles.
-    ImagePtr backgroundImage;
     TileSet mainTileSet;
     TileSet hudTiles;
     TileSet itemsSprites;
@@ -63,6 +73,10 @@ struct GlobalState
 
     // Camera/player.
     Vector2F cameraPosition;
+    uint32_t cameraZoomLevel;
+
+    // Renderer statistics.
+    RenderPassTimings lastRenderPassTimings;
 
     // The transient state. To keep the per map specific data.
     MapTransientState *mapTransientState;
@@ -81,6 +95,7 @@ extern HostInterface *hostInterface;
 #define global (*globalState)
 
 uint8_t *allocateTransientBytes(size_t byteCount);
+void startNewMap();
 
 template<typename T>
 T *newTransient()
@@ -4,20 +4,77 @@
 #include <stdint.h>
 #include <memory>
 #include "Box2.hpp"
+#include "PixelBlending.hpp"
+
+// Selects the cheapest way of drawing an image.
+enum class ImageAlphaClass : uint8_t {
+    Opaque,
+    BinaryAlpha,
+    Translucent,
+};
 
 class Image
 {
 public:
     Image()
-        : width(0), height(0), pitch(0), bpp(0)
+        : width(0), height(0), pitch(0), bpp(0), alphaClass(ImageAlphaClass::BinaryAlpha)
     {}
 
     uint32_t width;
     uint32_t height;
     uint32_t pitch;
     uint32_t bpp;
+    ImageAlphaClass alphaClass;
     std::unique_ptr<uint8_t[]> data;
 
+    // Converts the pixels into premultiplied alpha, and finds out how they need to be blended.
+    void premultiplyAlphaAndClassify()
+    {
+        auto row = data.get();
+        for(uint32_t y = 0; y < height; ++y)
+        {
+            auto pixels = reinterpret_cast<uint32_t*> (row);
+            for(uint32_t x = 0; x < width; ++x)
+            {
+                if((pixels[x] >> 24) != 0xff)
+                    pixels[x] = premultiplyPixelAlpha(pixels[x]);
+            }
+
+            row += pitch;
+        }
+
+        classifyAlpha();
+    }
+
+    void classifyAlpha()
+    {
+        bool hasTransparentPixels = false;
+        bool hasTranslucentPixels = false;
+
+        auto row = data.get();
+        for(uint32_t y = 0; y < height; ++y)
+        {
+            auto pixels = reinterpret_cast<const uint32_t*> (row);
+            for(uint32_t x = 0; x < width; ++x)
+            {
+                auto alpha = pixels[x] >> 24;
+                if(alpha == 0)
+                    hasTransparentPixels = true;
+                else if(alpha != 0xff)
+                    hasTranslucentPixels = true;
+            }
+
+            row += pitch;
+        }
+
+        if(hasTranslucentPixels)
+            alphaClass = ImageAlphaClass::Translucent;
+        else if(hasTransparentPixels)
+            alphaClass = ImageAlphaClass::BinaryAlpha;
+        else
+            alphaClass = ImageAlphaClass::Opaque;
+    }
+
     Vector2I extent() const
     {
         return Vector2I(width, height);
@@ -7,6 +7,7 @@
 #include "SDL_main.h"
 #include "HostInterface.hpp"
 #include "GameInterface.hpp"
+#include "SDL2AssetLoading.hpp"
 #include "ControllerState.hpp"
 #include <string>
 #include <algorithm>
@@ -157,25 +158,6 @@ void reloadGameInterface()
 
 #endif
 
-static std::string makeFullAssetPath(const std::string virtualPath)
-{
-    return "assets/" + virtualPath;
-}
-
-class NullSoundSample : public SoundSample
-{
-public:
-    virtual void play(bool looped, float volume) override
-    {
-        (void) looped;
-        (void) volume;
-    }
-
-    virtual void resume() override {}
-    virtual void pause() override {}
-    virtual void stop() override {}
-};
-
 class SDL2MixSoundSample : public SoundSample
 {
 public:
@@ -226,59 +208,12 @@ SDL2HostInterface SDL2HostInterface::singleton;
 
 MapFile *SDL2HostInterface::loadMapFile(const char *fileName)
 {
-    auto fullPath = makeFullAssetPath(fileName);
-    auto file = fopen(fullPath.c_str(), "rb");
-    if(!file)
-    {
-        fprintf(stderr, "Failed to load map file from: %s\n", fullPath.c_str());
-        return nullptr;
-    }
-
-    fseek(file, 0, SEEK_END);
-    auto fileSize = ftell(file);
-    fseek(file, 0, SEEK_SET);
-
-    std::unique_ptr<MapFile> result(new MapFile());
-    result->mapFileSize = fileSize;
-    result->mapFileContent.reset(new uint8_t[fileSize]);
-
-    if(fread(result->mapFileContent.get(), fileSize, 1, file) != 1)
-    {
-        fprintf(stderr, "Failed read the content from map file %s\n", fullPath.c_str());
-        return nullptr;
-    }
-
-    if(!result->validate())
-    {
-        fprintf(stderr, "Map file %s is invalid\n", fullPath.c_str());
-        return nullptr;
-    }
-
-    return result.release();
+    return loadMapFileAsset(fileName);
 }
 
 Image *SDL2HostInterface::loadImage(const char *fileName)
 {
-    auto fullPath = makeFullAssetPath(fileName);
-    auto surface = IMG_Load(fullPath.c_str());
-    if(!surface)
-    {
-        fprintf(stderr, "Failed to load image %s: %s\n", fileName, IMG_GetError());
-        return nullptr;
-    }
-
-    auto expectedSurface = SDL_ConvertSurfaceFormat(surface, SDL_PIXELFORMAT_ABGR8888, 0);
-    SDL_FreeSurface(surface);
-
-    auto result = ImagePtr(new Image);
-    result->width = expectedSurface->w;
-    result->height = expectedSurface->h;
-    result->pitch = expectedSurface->pitch;
-    result->bpp = expectedSurface->format->BitsPerPixel;
-    result->data.reset(new uint8_t[result->pitch*result->height]);
-    memcpy(result->data.get(), expectedSurface->pixels, result->pitch*result->height);
-    SDL_FreeSurface(expectedSurface);
-    return result.release();
+    return loadImageAsset(fileName);
 }
 
 SoundSample *SDL2HostInterface::loadSoundSample(const char *fileName)
@@ -322,6 +257,9 @@ static void onKeyEvent(const SDL_KeyboardEvent &event, bool isDown)
     case SDLK_d:
         keyboardControllerState.setButton(ControllerButton::RightTrigger, isDown);
         break;
+    case SDLK_c:
+        keyboardControllerState.setButton(ControllerButton::RightStick, isDown);
+        break;
     case SDLK_LEFT:
         if(isDown)
             keyboardControllerState.leftXAxis = -1;
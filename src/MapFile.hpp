@@ -7,6 +7,7 @@
 #include "Box2.hpp"
 #include "FixedString.hpp"
 #include "Coordinates.hpp"
+#include "TileGeometry.hpp"
 
 #define MapFileHeader_MagicCode "MAP "
 #define MapFileHeader_MagicCodeSize 4
@@ -14,6 +15,7 @@
 enum class MapFileLayerType : uint8_t {
     Tiles = 0,
     Entities = 1,
+    Properties = 2,
 };
 
 struct MapFileHeader
@@ -69,69 +71,83 @@ struct MapFileTileLayer : public MapFileLayer
         return Box2I(0.0f, extent);
     }
 
-    Vector2F pointFromPixelIntoTileSpace(const Vector2F &point, const Vector2F tileExtent) const
+    // The tile space transforms are templated on the tile geometry. See TileGeometry.hpp
+    template<typename TG>
+    Vector2F pointFromPixelIntoTileSpace(const Vector2F &point, const TG &tileGeometry) const
     {
-        return point/(Vector2F(tileExtent.x, tileExtent.y)) + Vector2F(0.0f, extent.y);
+        return point/tileGeometry.tileExtent() + Vector2F(0.0f, extent.y);
     }
 
-    Vector2F vectorFromPixelIntoTileSpace(const Vector2F &vector, const Vector2F tileExtent) const
+    template<typename TG>
+    Vector2F vectorFromPixelIntoTileSpace(const Vector2F &vector, const TG &tileGeometry) const
     {
-        return vector / tileExtent;
+        return vector/tileGeometry.tileExtent();
     }
 
-    inline Box2F boxFromPixelIntoTileSpace(const Box2F &box, const Vector2F tileExtent) const
+    template<typename TG>
+    inline Box2F boxFromPixelIntoTileSpace(const Box2F &box, const TG &tileGeometry) const
     {
-        return Box2F::withCenterAndHalfExtent(pointFromPixelIntoTileSpace(box.center(), tileExtent), vectorFromPixelIntoTileSpace(box.halfExtent(), tileExtent));
+        return Box2F::withCenterAndHalfExtent(pointFromPixelIntoTileSpace(box.center(), tileGeometry), vectorFromPixelIntoTileSpace(box.halfExtent(), tileGeometry));
     }
 
-    Vector2F pointFromWorldIntoTileSpace(const Vector2F &point, const Vector2F tileExtent) const
+    template<typename TG>
+    Vector2F pointFromWorldIntoTileSpace(const Vector2F &point, const TG &tileGeometry) const
     {
-        return pointFromPixelIntoTileSpace(pointFromWorldIntoPixelSpace(point), tileExtent);
+        return point*tileGeometry.tilesPerUnit()*Vector2F(1.0f, -1.0f) + Vector2F(0.0f, extent.y);
     }
 
-    Vector2F vectorFromWorldIntoTileSpace(const Vector2F &vector, const Vector2F tileExtent) const
+    template<typename TG>
+    Vector2F vectorFromWorldIntoTileSpace(const Vector2F &vector, const TG &tileGeometry) const
     {
-        return vectorFromPixelIntoTileSpace(vectorFromWorldIntoPixelSpace(vector), tileExtent);
+        return vector*tileGeometry.tilesPerUnit();
     }
 
-    inline Box2F boxFromWorldIntoTileSpace(const Box2F &box, const Vector2F tileExtent) const
+    template<typename TG>
+    inline Box2F boxFromWorldIntoTileSpace(const Box2F &box, const TG &tileGeometry) const
     {
-        return Box2F::withCenterAndHalfExtent(pointFromWorldIntoTileSpace(box.center(), tileExtent), vectorFromWorldIntoTileSpace(box.halfExtent(), tileExtent));
+        return Box2F::withCenterAndHalfExtent(pointFromWorldIntoTileSpace(box.center(), tileGeometry), vectorFromWorldIntoTileSpace(box.halfExtent(), tileGeometry));
     }
 
-    inline Ray2F rayFromWorldIntoTileSpace(const Ray2F &ray, const Vector2F tileExtent) const
+    template<typename TG>
+    inline Ray2F rayFromWorldIntoTileSpace(const Ray2F &ray, const TG &tileGeometry) const
     {
-        return Ray2F::fromSegment(pointFromWorldIntoTileSpace(ray.startPoint(), tileExtent), pointFromWorldIntoTileSpace(ray.endPoint(), tileExtent));
+        return Ray2F::fromSegment(pointFromWorldIntoTileSpace(ray.startPoint(), tileGeometry), pointFromWorldIntoTileSpace(ray.endPoint(), tileGeometry));
     }
 
-    Vector2F pointFromTileIntoPixelSpace(const Vector2F &point, const Vector2F tileExtent) const
+    template<typename TG>
+    Vector2F pointFromTileIntoPixelSpace(const Vector2F &point, const TG &tileGeometry) const
     {
-        return (point - Vector2F(0.0f, extent.y))*(Vector2F(tileExtent.x, tileExtent.y));
+        return (point - Vector2F(0.0f, extent.y))*tileGeometry.tileExtent();
     }
 
-    Vector2F vectorFromTileIntoPixelSpace(const Vector2F &vector, const Vector2F tileExtent) const
+    template<typename TG>
+    Vector2F vectorFromTileIntoPixelSpace(const Vector2F &vector, const TG &tileGeometry) const
     {
-        return vector * tileExtent;
+        return vector*tileGeometry.tileExtent();
     }
 
-    inline Box2F boxFromTileIntoPixelSpace(const Box2F &box, const Vector2F tileExtent) const
+    template<typename TG>
+    inline Box2F boxFromTileIntoPixelSpace(const Box2F &box, const TG &tileGeometry) const
     {
-        return Box2F::withCenterAndHalfExtent(pointFromTileIntoPixelSpace(box.center(), tileExtent), vectorFromTileIntoPixelSpace(box.halfExtent(), tileExtent));
+        return Box2F::withCenterAndHalfExtent(pointFromTileIntoPixelSpace(box.center(), tileGeometry), vectorFromTileIntoPixelSpace(box.halfExtent(), tileGeometry));
     }
 
-    Vector2F pointFromTileIntoWorldSpace(const Vector2F &point, const Vector2F tileExtent) const
+    template<typename TG>
+    Vector2F pointFromTileIntoWorldSpace(const Vector2F &point, const TG &tileGeometry) const
     {
-        return pointFromPixelIntoWorldSpace(pointFromTileIntoPixelSpace(point, tileExtent));
+        return (point - Vector2F(0.0f, extent.y))*tileGeometry.unitsPerTile()*Vector2F(1.0f, -1.0f);
     }
 
-    Vector2F vectorFromTileIntoWorldSpace(const Vector2F &vector, const Vector2F tileExtent) const
+    template<typename TG>
+    Vector2F vectorFromTileIntoWorldSpace(const Vector2F &vector, const TG &tileGeometry) const
     {
-        return vectorFromPixelIntoWorldSpace(vectorFromTileIntoPixelSpace(vector, tileExtent));
+        return vector*tileGeometry.unitsPerTile();
     }
 
-    inline Box2F boxFromTileIntoWorldSpace(const Box2F &box, const Vector2F tileExtent) const
+    template<typename TG>
+    inline Box2F boxFromTileIntoWorldSpace(const Box2F &box, const TG &tileGeometry) const
     {
-        return Box2F::withCenterAndHalfExtent(pointFromTileIntoWorldSpace(box.center(), tileExtent), vectorFromTileIntoWorldSpace(box.halfExtent(), tileExtent));
+        return Box2F::withCenterAndHalfExtent(pointFromTileIntoWorldSpace(box.center(), tileGeometry), vectorFromTileIntoWorldSpace(box.halfExtent(), tileGeometry));
     }
 
 };
@@ -149,6 +165,19 @@ struct MapFileEntityLayer : public MapFileLayer
     MapFileEntity entities[];
 };
 
+struct MapFileProperty
+{
+    SmallFixedString<32> name;
+    SmallFixedString<32> value;
+};
+
+// The custom properties of the map in the source file.
+struct MapFilePropertyLayer : public MapFileLayer
+{
+    uint32_t propertyCount;
+    MapFileProperty properties[];
+};
+
 class MapFile
 {
 public:
@@ -187,6 +216,24 @@ public:
         return header().tileExtent;
     }
 
+    // Returns an empty string when the map does not have the property.
+    std::string propertyNamed(const std::string &name)
+    {
+        std::string result;
+        layersDo([&](const MapFileLayer &layer) {
+            if(layer.type != MapFileLayerType::Properties)
+                return;
+
+            auto &propertyLayer = reinterpret_cast<const MapFilePropertyLayer &> (layer);
+            for(uint32_t i = 0; i < propertyLayer.propertyCount; ++i)
+            {
+                if(std::string(propertyLayer.properties[i].name) == name)
+                    result = propertyLayer.properties[i].value;
+            }
+        });
+        return result;
+    }
+
     size_t mapFileSize;
     std::unique_ptr<uint8_t[]> mapFileContent;
 };
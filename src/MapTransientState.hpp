@@ -4,11 +4,27 @@
 #include "FixedVector.hpp"
 #include "MapFile.hpp"
 #include "Entity.hpp"
+#include "CollisionStatistics.hpp"
+#include "Image.hpp"
 
 enum {
     MaxNumberOfLayers = 5,
     MaxNumberOfEntities = 4096,
     MaxNumberOfEntitiesPerLayer = 512,
+    MaxNumberOfParallaxLayers = 4,
+    MaxNumberOfEntitiesPerCollisionGridCell = 16,
+    MaxNumberOfCollidersPerBVHLeaf = 4,
+    MaxColliderTileExtent = 16,
+    MaxColliderBVHDepth = 32,
+    MaxNumberOfTraversalTestedColliders = 16,
+    MaxNumberOfSensorContacts = 1024,
+    MaxSolidTileDistance = 255,
+    TileOccupancyBlockSizeLog2 = 3,
+    TileOccupancyBlockSize = 1 << TileOccupancyBlockSizeLog2,
+    TargetShadowFieldRadius = 14,
+    TargetShadowFieldExtent = TargetShadowFieldRadius*2 + 1,
+    MaxNumberOfTargetShadowFields = 2,
+    MinNumberOfSightTestsForTargetShadowField = 8,
 };
 
 enum class MapLayerType : uint8_t {
@@ -21,6 +37,19 @@ struct MapLayerStateCommon
     MapLayerType type;
 };
 
+struct MapColliderBVHNode
+{
+    Box2F bounds;
+    uint32_t firstIndex; // The first child node, or the first collider of a leaf.
+    uint32_t colliderCount; // Zero for the inner nodes.
+};
+
+enum class TileBlockOccupancy : uint8_t {
+    Empty,
+    Mixed,
+    Full,
+};
+
 struct MapSolidLayerState : public MapLayerStateCommon
 {
     MapSolidLayerState()
@@ -29,6 +58,104 @@ struct MapSolidLayerState : public MapLayerStateCommon
     }
 
     const MapFileTileLayer *mapTileLayer;
+
+    // The collision structures are only built for the solid layers.
+    // One bit per non empty tile. The rows are padded to 64 bits.
+    uint64_t *occupancy;
+    int32_t occupancyWordsPerRow;
+
+    // The solid tiles merged into world space rectangles, with a bounding volume hierarchy.
+    Box2F *colliders;
+    uint32_t colliderCount;
+    MapColliderBVHNode *colliderNodes;
+    uint32_t colliderNodeCount;
+
+    // The collider that covers each non empty tile, for walking the tiles along the short sweeps.
+    uint32_t *tileColliderIndices;
+
+    // The Chebyshev distance in tiles from each tile to the closest solid tile, saturated
+    // to MaxSolidTileDistance. The tiles closer than the distance are empty.
+    uint8_t *solidDistance;
+
+    int32_t solidDistanceAt(int32_t x, int32_t y) const
+    {
+        return solidDistance[y*mapTileLayer->extent.x + x];
+    }
+
+    // Whether the distance of the center tile proves that the non empty box has no solid tile.
+    bool isTileBoxFarFromSolid(const Box2I &box) const
+    {
+        auto centerX = (box.min.x + box.max.x - 1) / 2;
+        auto centerY = (box.min.y + box.max.y - 1) / 2;
+        auto reach = std::max(std::max(centerX - box.min.x, box.max.x - 1 - centerX),
+            std::max(centerY - box.min.y, box.max.y - 1 - centerY));
+        return reach < solidDistanceAt(centerX, centerY);
+    }
+
+    // The occupancy of the blocks of TileOccupancyBlockSize^2 tiles. The parts of
+    // the blocks on the border that are outside of the layer are ignored.
+    TileBlockOccupancy *blockOccupancy;
+    Vector2I blockExtent;
+
+    TileBlockOccupancy blockOccupancyAt(int32_t blockX, int32_t blockY) const
+    {
+        return blockOccupancy[blockY*blockExtent.x + blockX];
+    }
+
+    // The occupancy of the blocks that touch the non empty box, which must be inside of the tile grid bounds.
+    TileBlockOccupancy blockOccupancyOfTileBox(const Box2I &box) const
+    {
+        auto result = TileBlockOccupancy::Empty;
+        for(int32_t y = box.min.y >> TileOccupancyBlockSizeLog2; y <= (box.max.y - 1) >> TileOccupancyBlockSizeLog2; ++y)
+        {
+            for(int32_t x = box.min.x >> TileOccupancyBlockSizeLog2; x <= (box.max.x - 1) >> TileOccupancyBlockSizeLog2; ++x)
+            {
+                auto occupancy = blockOccupancyAt(x, y);
+                if(occupancy == TileBlockOccupancy::Full)
+                    return TileBlockOccupancy::Full;
+                if(occupancy == TileBlockOccupancy::Mixed)
+                    result = TileBlockOccupancy::Mixed;
+            }
+        }
+        return result;
+    }
+
+    bool isTileOccupied(int32_t x, int32_t y) const
+    {
+        return (occupancy[y*occupancyWordsPerRow + (x >> 6)] >> (x & 63)) & 1;
+    }
+
+    // The box must be inside of the tile grid bounds.
+    bool hasOccupiedTileInBox(const Box2I &box) const
+    {
+        if(box.isEmpty())
+            return false;
+
+        auto firstWord = box.min.x >> 6;
+        auto lastWord = (box.max.x - 1) >> 6;
+        auto firstMask = ~uint64_t(0) << (box.min.x & 63);
+        auto lastMask = ~uint64_t(0) >> (63 - ((box.max.x - 1) & 63));
+
+        auto row = occupancy + box.min.y*occupancyWordsPerRow;
+        if(firstWord == lastWord)
+        {
+            // The common case of a small box. The rows are merged without branching.
+            uint64_t merged = 0;
+            for(int32_t y = box.min.y; y < box.max.y; ++y, row += occupancyWordsPerRow)
+                merged |= row[firstWord];
+            return (merged & firstMask & lastMask) != 0;
+        }
+
+        for(int32_t y = box.min.y; y < box.max.y; ++y, row += occupancyWordsPerRow)
+        {
+            uint64_t merged = (row[firstWord] & firstMask) | (row[lastWord] & lastMask);
+            for(int32_t i = firstWord + 1; i < lastWord; ++i)
+                merged |= row[i];
+            if(merged)
+                return true;
+        }
+        return false;
+    }
 };
 
 struct MapEntityLayerState : public MapLayerStateCommon
@@ -41,6 +168,155 @@ struct MapEntityLayerState : public MapLayerStateCommon
     FixedVector<Entity*, MaxNumberOfEntitiesPerLayer> entities;
 };
 
+struct ParallaxLayerState
+{
+    // The layer image, converted into a seamless horizontally wrapping strip.
+    uint32_t *pixels;
+    Vector2I extent;
+    float scrollFactor;
+    ImageAlphaClass alphaClass;
+};
+
+#define MinimapBackgroundColor 0xff202020
+
+// A downsampled view of the whole map, with one texel per tile.
+struct MapMinimapState
+{
+    uint32_t *texels;
+    Vector2I extent;
+    const MapFileTileLayer *referenceLayer;
+
+    // The texels downsampled to fit in the window of the framebuffer. They are
+    // only computed again when the framebuffer needs another factor.
+    uint32_t *downsampledTexels;
+    Vector2I downsampledExtent;
+    int32_t downsampleFactor;
+};
+
+#define CollisionGridCellSize 4.0f
+
+typedef FixedVector<Entity*, MaxNumberOfEntities> CollisionEntityList;
+
+static_assert(MaxNumberOfEntitiesPerCollisionGridCell % 4 == 0 && MaxNumberOfEntitiesPerCollisionGridCell < 32,
+    "The entries of a collision grid cell are tested four at a time, and selected with a 32 bits mask.");
+
+// The bounding boxes of the entities are mirrored as arrays in the same order,
+// so that the queries test several of them at once.
+struct MapCollisionGridCell
+{
+    FixedVector<Entity*, MaxNumberOfEntitiesPerCollisionGridCell> entities;
+    alignas(16) float minX[MaxNumberOfEntitiesPerCollisionGridCell];
+    alignas(16) float minY[MaxNumberOfEntitiesPerCollisionGridCell];
+    alignas(16) float maxX[MaxNumberOfEntitiesPerCollisionGridCell];
+    alignas(16) float maxY[MaxNumberOfEntitiesPerCollisionGridCell];
+    alignas(16) uint32_t categories[MaxNumberOfEntitiesPerCollisionGridCell];
+
+    uint32_t entriesMask() const
+    {
+        return (1u << entities.size()) - 1;
+    }
+
+    void setBoxAt(size_t index, const Box2F &box)
+    {
+        minX[index] = box.min.x;
+        minY[index] = box.min.y;
+        maxX[index] = box.max.x;
+        maxY[index] = box.max.y;
+    }
+
+    void addEntity(Entity *entity, const Box2F &box)
+    {
+        setBoxAt(entities.size(), box);
+        categories[entities.size()] = entity->collisionCategory;
+        entities.push_back(entity);
+    }
+
+    void setEntityBox(Entity *entity, const Box2F &box)
+    {
+        for(size_t i = 0; i < entities.size(); ++i)
+        {
+            if(entities[i] == entity)
+                setBoxAt(i, box);
+        }
+    }
+
+    void removeEntity(Entity *entity)
+    {
+        size_t destIndex = 0;
+        for(size_t i = 0; i < entities.size(); ++i)
+        {
+            if(entities[i] == entity)
+                continue;
+
+            entities[destIndex] = entities[i];
+            minX[destIndex] = minX[i];
+            minY[destIndex] = minY[i];
+            maxX[destIndex] = maxX[i];
+            maxY[destIndex] = maxY[i];
+            categories[destIndex] = categories[i];
+            ++destIndex;
+        }
+
+        while(entities.size() > destIndex)
+            entities.pop_back();
+    }
+};
+
+// A uniform grid over the map with the collision entities, for the broad phase.
+// Entities that do not fit in their cells are kept in the overflow list.
+struct MapCollisionGridState
+{
+    MapCollisionGridCell *cells;
+    Vector2I extent;
+    CollisionEntityList overflowEntities;
+    uint32_t lastSequenceNumber;
+    uint32_t queryStamp;
+};
+
+static_assert(TargetShadowFieldExtent <= 64, "The rows of a target shadow field are 64 bits masks.");
+
+// The tiles around a target point from where every segment towards the point
+// crosses a solid tile, found with shadowcasting. The other tiles may or may
+// not see the point. The shadows are only computed when enough sight tests
+// towards the point are done in a tick.
+struct MapTargetShadowField
+{
+    Vector2F origin;
+    uint32_t tick;
+    uint32_t sightTestCount;
+    bool isValid;
+    bool isComputed;
+
+    Vector2I windowMin;
+    uint64_t shadowRows[TargetShadowFieldExtent];
+
+    bool isTileInShadow(const Vector2I &tile) const
+    {
+        auto windowTile = tile - windowMin;
+        if(windowTile.x < 0 || windowTile.y < 0 || windowTile.x >= TargetShadowFieldExtent || windowTile.y >= TargetShadowFieldExtent)
+            return false;
+        return (shadowRows[windowTile.y] >> windowTile.x) & 1;
+    }
+};
+
+// An overlap between a sensor and an entity in its collision mask.
+struct MapSensorContact
+{
+    Entity *sensor;
+    Entity *entity;
+};
+
+// The rays swept together against the world at the start of a tick. It is
+// defined with the collision queries.
+struct CollisionRayBatch;
+
+// The number of times that the entities were put to sleep and woken up in the map.
+struct EntitySleepStatistics
+{
+    uint32_t sleepCount;
+    uint32_t wakeCount;
+};
+
 struct MapTransientState
 {
     // Per-layer required state.
@@ -52,6 +328,12 @@ struct MapTransientState
     // Some special layers.
     MapEntityLayerState *projectileEntityLayer;
 
+    // The background layers, from back to front.
+    FixedVector<ParallaxLayerState, MaxNumberOfParallaxLayers> parallaxLayers;
+
+    // The minimap.
+    MapMinimapState minimap;
+
     // The zombie entities list.
     FixedVector<Entity*, MaxNumberOfEntities> zombieEntities;
 
@@ -60,9 +342,25 @@ struct MapTransientState
 
     // The entities that may affect collisions.
     FixedVector<Entity*, MaxNumberOfEntities> collisionEntities;
+    MapCollisionGridState collisionGrid;
+    CollisionRayBatch *collisionRayBatch;
+    CollisionStatistics collisionStatistics;
+    MapTargetShadowField targetShadowFields[MaxNumberOfTargetShadowFields];
+
+    // The sensors and the collision entities sorted along x, and their overlaps in the last tick.
+    FixedVector<Entity*, MaxNumberOfEntities> sensorContactEntities;
+    FixedVector<MapSensorContact, MaxNumberOfSensorContacts> sensorContacts;
+
+    // The overlaps found in the current tick, and the intervals still open along x while sweeping.
+    // The overlaps past the capacity are dropped and counted.
+    FixedVector<MapSensorContact, MaxNumberOfSensorContacts> newSensorContacts;
+    CollisionEntityList openSensors;
+    CollisionEntityList openSensorContactEntities;
+    uint32_t droppedSensorContactCount;
 
     // The entities that need periodical updating.
     FixedVector<Entity*, MaxNumberOfEntities> tickingEntitites;
+    EntitySleepStatistics sleepStatistics;
 
     // Some special entities.
     Entity *activePlayer;
@@ -75,6 +373,7 @@ struct MapTransientState
 
     // How much do we have in this map?
     float timeInMap;
+    uint32_t tickCount;
 
     // Is this a game over?
     bool isGameOver;
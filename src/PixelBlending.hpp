@@ -0,0 +1,104 @@
+#ifndef PIXEL_BLENDING_HPP
+#define PIXEL_BLENDING_HPP
+
+#include <stdint.h>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define USE_SSE2_PIXEL_BLENDING
+#include <emmintrin.h>
+#endif
+
+// Exact division by 255 of values in the [0, 255*255] range.
+inline uint32_t divideBy255(uint32_t x)
+{
+    return (x + 1 + (x >> 8)) >> 8;
+}
+
+inline uint32_t premultiplyPixelAlpha(uint32_t pixel)
+{
+    auto alpha = pixel >> 24;
+    return (alpha << 24) |
+        (divideBy255(((pixel >> 16) & 0xff)*alpha) << 16) |
+        (divideBy255(((pixel >> 8) & 0xff)*alpha) << 8) |
+        divideBy255((pixel & 0xff)*alpha);
+}
+
+// Computes source + dest*(255 - alpha)/255 for a premultiplied source pixel.
+// The red/blue and the green/alpha channel pairs are packed in a single word.
+inline uint32_t blendPremultipliedPixel(uint32_t dest, uint32_t source)
+{
+    auto inverseAlpha = 255 - (source >> 24);
+    auto redBlue = (dest & 0x00ff00ff)*inverseAlpha;
+    auto greenAlpha = ((dest >> 8) & 0x00ff00ff)*inverseAlpha;
+    redBlue = ((redBlue + 0x00010001 + ((redBlue >> 8) & 0x00ff00ff)) >> 8) & 0x00ff00ff;
+    greenAlpha = (greenAlpha + 0x00010001 + ((greenAlpha >> 8) & 0x00ff00ff)) & 0xff00ff00;
+    return source + (redBlue | greenAlpha);
+}
+
+#ifdef USE_SSE2_PIXEL_BLENDING
+// Blends four pixels, as two pairs of pixels with 16 bits per channel.
+inline __m128i blendPremultipliedPixels(__m128i dest, __m128i source)
+{
+    auto zero = _mm_setzero_si128();
+    auto one = _mm_set1_epi16(1);
+    auto maxAlpha = _mm_set1_epi16(255);
+
+    auto sourceLow = _mm_unpacklo_epi8(source, zero);
+    auto sourceHigh = _mm_unpackhi_epi8(source, zero);
+    auto destLow = _mm_unpacklo_epi8(dest, zero);
+    auto destHigh = _mm_unpackhi_epi8(dest, zero);
+
+    auto inverseAlphaLow = _mm_sub_epi16(maxAlpha, _mm_shufflehi_epi16(_mm_shufflelo_epi16(sourceLow, 0xff), 0xff));
+    auto inverseAlphaHigh = _mm_sub_epi16(maxAlpha, _mm_shufflehi_epi16(_mm_shufflelo_epi16(sourceHigh, 0xff), 0xff));
+
+    auto productLow = _mm_mullo_epi16(destLow, inverseAlphaLow);
+    auto productHigh = _mm_mullo_epi16(destHigh, inverseAlphaHigh);
+    productLow = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(productLow, one), _mm_srli_epi16(productLow, 8)), 8);
+    productHigh = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(productHigh, one), _mm_srli_epi16(productHigh, 8)), 8);
+
+    return _mm_packus_epi16(_mm_add_epi16(sourceLow, productLow), _mm_add_epi16(sourceHigh, productHigh));
+}
+#endif
+
+// Blends a row of premultiplied pixels. The source may be traversed backwards, for flipping.
+inline void blendPremultipliedRow(uint32_t *dest, const uint32_t *source, int32_t count, int32_t sourceIncrement)
+{
+    int32_t x = 0;
+#ifdef USE_SSE2_PIXEL_BLENDING
+    auto alphaMask = _mm_set1_epi32(0xff000000);
+    for(; x + 4 <= count; x += 4)
+    {
+        __m128i sourcePixels;
+        if(sourceIncrement > 0)
+            sourcePixels = _mm_loadu_si128(reinterpret_cast<const __m128i*> (source));
+        else
+            sourcePixels = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*> (source - 3)), _MM_SHUFFLE(0, 1, 2, 3));
+        source += sourceIncrement*4;
+
+        auto sourceAlpha = _mm_and_si128(sourcePixels, alphaMask);
+        auto transparentMask = _mm_movemask_epi8(_mm_cmpeq_epi32(sourceAlpha, _mm_setzero_si128()));
+        if(transparentMask == 0xffff)
+            continue;
+
+        auto destPixels = reinterpret_cast<__m128i*> (dest + x);
+        auto opaqueMask = _mm_movemask_epi8(_mm_cmpeq_epi32(sourceAlpha, alphaMask));
+        if(opaqueMask == 0xffff)
+            _mm_storeu_si128(destPixels, sourcePixels);
+        else
+            _mm_storeu_si128(destPixels, blendPremultipliedPixels(_mm_loadu_si128(destPixels), sourcePixels));
+    }
+#endif
+
+    for(; x < count; ++x)
+    {
+        auto sourcePixel = *source;
+        auto alpha = sourcePixel >> 24;
+        if(alpha == 0xff)
+            dest[x] = sourcePixel;
+        else if(alpha != 0)
+            dest[x] = blendPremultipliedPixel(dest[x], sourcePixel);
+        source += sourceIncrement;
+    }
+}
+
+#endif //PIXEL_BLENDING_HPP
@@ -3,6 +3,7 @@
 #include "GameLogic.hpp"
 #include "MapTransientState.hpp"
 #include <algorithm>
+#include <chrono>
 #include <vector>
 #include <stdio.h>
 #include <time.h>
@@ -26,46 +27,144 @@ static uint32_t RainbowColorTable[] {
 };
 static const int RainbowColorTableSize = sizeof(RainbowColorTable)/sizeof(RainbowColorTable[0]);
 
+enum {
+    MaxNumberOfViewports = 4,
+    MaxNumberOfMapRenderCommands = 8192,
+};
+
+enum class RenderCommandType : uint8_t {
+    Blit,
+    BlitText,
+    FillRectangle,
+    CopyMinimap, // The color is the downsampling factor of the texels.
+    Fade,
+};
+
+// A drawing operation recorded once per frame. Map commands are recorded in
+// map pixel space and replayed into each one of the viewports. Screen commands
+// are recorded in framebuffer space, for the overlays and the fade.
+struct RenderCommand
+{
+    RenderCommandType type;
+    bool flipX;
+    bool flipY;
+    uint32_t color;
+    const Image *image;
+    Box2I sourceRectangle;
+    Box2I destinationRectangle;
+};
+
+struct RenderViewport
+{
+    Box2I rectangle;
+    Vector2F cameraFocus;
+    uint32_t borderColor;
+
+    Vector2F cameraTranslation;
+    Vector2I pixelOffset;
+    Box2F worldViewVolume;
+    Box2I mapPixelBounds;
+};
+
+typedef FixedVector<RenderCommand, MaxNumberOfMapRenderCommands> RenderCommandList;
+
+static RenderCommandList mapRenderCommands;
+static RenderCommandList screenRenderCommands;
+
 class Renderer
 {
 public:
     Renderer(const Framebuffer &f)
-        : framebuffer(f)
+        : framebuffer(f), clipRectangle(f.bounds()), hasMapRenderCommandsOverflow(false), flushedViewport(nullptr)
+    {
+        zoomLevel = std::min(global.cameraZoomLevel, uint32_t(MaxNumberOfTileSetMipLevels - 1));
+        zoomScale = 1.0f / float(1 << zoomLevel);
+    }
+
+    const Framebuffer &framebuffer;
+    Box2I clipRectangle;
+    FixedVector<RenderViewport, MaxNumberOfViewports> viewports;
+
+    // The map is drawn scaled down by a power of two, from the matching tile set mip levels.
+    uint32_t zoomLevel;
+    float zoomScale;
+
+    // The map is recorded without any camera translation.
+    Vector2F cameraTranslation;
+
+    // Some map commands did not fit in the list shared by the viewports. The
+    // viewports are then recorded one at a time, and the list is drawn into
+    // the flushed viewport each time it gets full.
+    bool hasMapRenderCommandsOverflow;
+    const RenderViewport *flushedViewport;
+
+    void addViewport(const Box2I &rectangle, const Vector2F &cameraFocus, uint32_t borderColor = 0)
+    {
+        RenderViewport viewport;
+        viewport.rectangle = rectangle.intersectionWithBox(framebuffer.bounds());
+        viewport.cameraFocus = cameraFocus;
+        viewport.borderColor = borderColor;
+        viewports.push_back(viewport);
+    }
+
+    void setupViewports()
     {
-        halfFramebufferOffset = f.extent().asVector2F()/2;
-        framebufferUnitExtent = f.extent().asVector2F()*UnitsPerPixel;
-        halfFramebufferUnitOffset = halfFramebufferOffset*Vector2F(UnitsPerPixel, -UnitsPerPixel);
+        addViewport(framebuffer.bounds(), global.cameraPosition);
 
+        auto transientState = global.mapTransientState;
+        if(global.isVipViewportEnabled && transientState && transientState->activeVIP)
         {
-            // Break time.
-            auto fbBounds = f.bounds();
-            viewVolumeInUnits = Box2F::withCenterAndHalfExtent(fbBounds.center().asVector2F()*Vector2F(UnitsPerPixel, -UnitsPerPixel), fbBounds.halfExtent().asVector2F()*UnitsPerPixel);
+            auto extent = framebuffer.extent() / 3;
+            auto margin = Vector2I(8);
+            auto rectangle = Box2I::withMinAndExtent(framebuffer.extent() - extent - margin, extent);
+            addViewport(rectangle, transientState->activeVIP->position, 0xffcccccc);
         }
     }
 
-    const Framebuffer &framebuffer;
-    Box2F viewVolumeInUnits;
-    Box2F worldViewVolumeInUnits;
+    void computeViewportCamera(RenderViewport &viewport)
+    {
+        auto extent = viewport.rectangle.extent().asVector2F();
+        auto unitsPerViewPixel = UnitsPerPixel/zoomScale;
+        auto unitExtent = extent*unitsPerViewPixel;
+        auto halfUnitOffset = extent/2*Vector2F(unitsPerViewPixel, -unitsPerViewPixel);
 
-    Vector2F cameraTranslation;
-    Vector2I cameraPixelOffset;
-    Vector2F halfFramebufferOffset;
-    Vector2F framebufferUnitExtent;
-    Vector2F halfFramebufferUnitOffset;
+        auto mapExtent = global.currentMap->extent().asVector2F()*UnitsPerPixel;
+        auto mapClippingExtent = Vector2F(std::max(mapExtent.x - unitExtent.x, unitExtent.x), mapExtent.y);
+
+        auto cameraPosition = viewport.cameraFocus - halfUnitOffset;
+        cameraPosition = std::max(cameraPosition, Vector2F(0.0, unitExtent.y));
+        cameraPosition = std::min(cameraPosition, mapClippingExtent);
+
+        viewport.cameraTranslation = -cameraPosition;
+        viewport.worldViewVolume = Box2F::withMinAndExtent(cameraPosition - Vector2F(0.0f, unitExtent.y), unitExtent);
 
-    void renderBackground()
+        auto cameraPixelOffset = (pointFromWorldIntoPixelSpace(viewport.cameraTranslation)*zoomScale).floor().asVector2I();
+        viewport.pixelOffset = viewport.rectangle.min + cameraPixelOffset;
+        viewport.mapPixelBounds = viewport.rectangle.translatedBy(-viewport.pixelOffset);
+    }
+
+    void renderBackground(const RenderViewport &viewport)
     {
-        if(global.backgroundImage.get())
+        // An opaque back layer covers the whole viewport, so there is nothing to clear.
+        auto transientState = global.mapTransientState;
+        auto hasParallaxLayers = transientState && !transientState->parallaxLayers.empty();
+        if(!hasParallaxLayers || transientState->parallaxLayers[0].alphaClass != ImageAlphaClass::Opaque)
+            clearBackground();
+
+        if(hasParallaxLayers)
         {
-            blitImage(global.backgroundImage, global.backgroundImage->bounds(), 0);
-            return;
+            for(auto &layer : transientState->parallaxLayers)
+                renderParallaxLayer(layer, viewport);
         }
-        
-        auto destRow = framebuffer.pixels;
-        for(uint32_t y = 0; y < framebuffer.height; ++y)
+    }
+
+    void clearBackground()
+    {
+        auto destRow = framebuffer.pixels + framebuffer.pitch*clipRectangle.min.y + clipRectangle.min.x*4;
+        for(int32_t y = clipRectangle.min.y; y < clipRectangle.max.y; ++y)
         {
             auto dest = reinterpret_cast<uint32_t*> (destRow);
-            for(uint32_t x = 0; x < framebuffer.width; ++x)
+            for(int32_t x = clipRectangle.min.x; x < clipRectangle.max.x; ++x)
             {
                 auto px = int(x + global.currentTime*10.0);
                 auto py = int(y);
@@ -76,44 +175,100 @@ public:
         }
     }
 
+    void renderParallaxLayer(const ParallaxLayerState &layer, const RenderViewport &viewport)
+    {
+        auto stripWidth = layer.extent.x;
+        auto cameraPixelPosition = -viewport.cameraTranslation.x*PixelsPerUnit*zoomScale;
+        auto scroll = int32_t(floor(cameraPixelPosition*layer.scrollFactor)) % stripWidth;
+        if(scroll < 0)
+            scroll += stripWidth;
+
+        auto startColumn = (scroll + clipRectangle.min.x - viewport.rectangle.min.x) % stripWidth;
+        auto sourceY = (clipRectangle.min.y - viewport.rectangle.min.y) % layer.extent.y;
+        auto destRow = framebuffer.pixels + framebuffer.pitch*clipRectangle.min.y + clipRectangle.min.x*4;
+        for(int32_t y = clipRectangle.min.y; y < clipRectangle.max.y; ++y)
+        {
+            auto sourceRow = layer.pixels + sourceY*stripWidth;
+            if(++sourceY == layer.extent.y)
+                sourceY = 0;
+
+            auto dest = reinterpret_cast<uint32_t*> (destRow);
+            auto column = startColumn;
+            auto remainingWidth = clipRectangle.max.x - clipRectangle.min.x;
+
+            // Copy the tail of the strip, and then wrap into its head.
+            while(remainingWidth > 0)
+            {
+                auto copyWidth = std::min(stripWidth - column, remainingWidth);
+                if(layer.alphaClass == ImageAlphaClass::Opaque)
+                {
+                    memcpy(dest, sourceRow + column, copyWidth*4);
+                }
+                else
+                    blendPremultipliedRow(dest, sourceRow + column, copyWidth, 1);
+
+                dest += copyWidth;
+                remainingWidth -= copyWidth;
+                column = 0;
+            }
+
+            destRow += framebuffer.pitch;
+        }
+    }
+
     Vector2F worldToViewPixels(const Vector2F &p) const
     {
-        return pointFromWorldIntoPixelSpace(p + cameraTranslation);
+        return pointFromWorldIntoPixelSpace(p + cameraTranslation)*zoomScale;
     }
 
     Box2F worldToViewPixels(const Box2F &b) const
     {
-        return boxFromWorldIntoPixelSpace(b.translatedBy(cameraTranslation));
+        auto pixelBox = boxFromWorldIntoPixelSpace(b.translatedBy(cameraTranslation));
+        return Box2F(pixelBox.min*zoomScale, pixelBox.max*zoomScale);
     }
 
-    void renderCurrentMap()
+    uint32_t mipLevelFor(const TileSet &tileSet) const
     {
-        if(!global.mapTransientState)
-            return;
+        return std::min(zoomLevel, tileSet.mipLevelCount - 1);
+    }
+
+    // The extent in which the tiles of a tile set are drawn with the current zoom.
+    Vector2I zoomedTileExtent(const TileSet &tileSet) const
+    {
+        return tileSet.mipLevelTileExtent(mipLevelFor(tileSet));
+    }
 
+    bool isWorldBoxVisibleInSomeViewport(const Box2F &box) const
+    {
+        for(auto &viewport : viewports)
         {
-            auto mapExtent = global.currentMap->extent().asVector2F()*UnitsPerPixel;
-            auto mapClippingExtent = Vector2F(std::max(mapExtent.x - framebufferUnitExtent.x, framebufferUnitExtent.x), mapExtent.y);
+            if(viewport.worldViewVolume.intersectsWithBox(box))
+                return true;
+        }
 
-            auto cameraPosition = Vector2F(global.cameraPosition.x, global.cameraPosition.y) - halfFramebufferUnitOffset;
-            cameraPosition = std::max(cameraPosition, Vector2F(0.0, framebufferUnitExtent.y));
-            cameraPosition = std::min(cameraPosition, mapClippingExtent);
+        return false;
+    }
 
-            cameraTranslation = -cameraPosition;
-        }
+    // Records the map drawing commands a single time, for all of the viewports.
+    void recordCurrentMap()
+    {
+        mapRenderCommands.clear();
+        if(!global.mapTransientState)
+            return;
 
-        cameraPixelOffset = pointFromWorldIntoPixelSpace(cameraTranslation).floor().asVector2I();
-        worldViewVolumeInUnits = viewVolumeInUnits.translatedBy(-cameraTranslation);
+        cameraTranslation = Vector2F::zeros();
+        for(auto &viewport : viewports)
+            computeViewportCamera(viewport);
 
         for(auto layer : global.mapTransientState->layers)
         {
             switch(layer->type)
             {
             case MapLayerType::Solid:
-                renderTileLayer(*reinterpret_cast<MapSolidLayerState*> (layer)->mapTileLayer);
+                recordTileLayer(*reinterpret_cast<MapSolidLayerState*> (layer));
                 break;
             case MapLayerType::Entities:
-                renderEntityLayer(reinterpret_cast<MapEntityLayerState*> (layer));
+                recordEntityLayer(reinterpret_cast<MapEntityLayerState*> (layer));
                 break;
             default:
                 break;
@@ -121,10 +276,88 @@ public:
         }
     }
 
-    void renderEntityLayer(MapEntityLayerState *layer)
+    // Draws the border and the background of a viewport.
+    void renderViewportFrame(const RenderViewport &viewport)
+    {
+        if(viewport.borderColor)
+        {
+            clipRectangle = framebuffer.bounds();
+            fillRectangle(Box2I(viewport.rectangle.min - 2, viewport.rectangle.max + 2), viewport.borderColor);
+        }
+
+        clipRectangle = viewport.rectangle.intersectionWithBox(framebuffer.bounds());
+        renderBackground(viewport);
+    }
+
+    void replayCommand(const RenderCommand &command, const Vector2I &pixelOffset)
+    {
+        auto destination = command.destinationRectangle.min + pixelOffset;
+        switch(command.type)
+        {
+        case RenderCommandType::Blit:
+            blitImage(*command.image, command.sourceRectangle, destination, command.flipX, command.flipY);
+            break;
+        case RenderCommandType::BlitText:
+            blitTextImage(*command.image, command.sourceRectangle, destination, command.color, command.flipX, command.flipY);
+            break;
+        case RenderCommandType::FillRectangle:
+            fillRectangle(command.destinationRectangle.translatedBy(pixelOffset), command.color);
+            break;
+        case RenderCommandType::CopyMinimap:
+            copyMinimapTexels(command.color, command.destinationRectangle.translatedBy(pixelOffset));
+            break;
+        case RenderCommandType::Fade:
+            fadeRectangle(command.destinationRectangle.translatedBy(pixelOffset), command.color);
+            break;
+        }
+    }
+
+    void replayMapCommands(const RenderViewport &viewport)
+    {
+        for(auto &command : mapRenderCommands)
+        {
+            if(command.destinationRectangle.intersectsWithBox(viewport.mapPixelBounds))
+                replayCommand(command, viewport.pixelOffset);
+        }
+    }
+
+    void renderViewport(const RenderViewport &viewport)
+    {
+        renderViewportFrame(viewport);
+        if(!global.mapTransientState)
+            return;
+
+        replayMapCommands(viewport);
+    }
+
+    // The fallback when the map commands of all of the viewports do not fit
+    // together. The drawing order is kept, because each viewport is finished
+    // before the next one, and its commands are flushed in recording order.
+    void recordAndRenderEachViewport()
+    {
+        auto allViewports = viewports;
+        for(auto &viewport : allViewports)
+        {
+            viewports.clear();
+            viewports.push_back(viewport);
+            renderViewportFrame(viewport);
+
+            flushedViewport = &viewports[0];
+            recordCurrentMap();
+            replayMapCommands(viewports[0]);
+            flushedViewport = nullptr;
+        }
+
+        viewports = allViewports;
+    }
+
+    void recordEntityLayer(MapEntityLayerState *layer)
     {
         for(auto entity : layer->entities)
-            entity->renderWith(*this);
+        {
+            if(isWorldBoxVisibleInSomeViewport(entity->visualBoundingBox()))
+                entity->renderWith(*this);
+        }
     }
 
     void drawCharacter(char character, const Vector2I &destPosition, uint32_t color)
@@ -143,7 +376,8 @@ public:
         tileSet.computeTileColumnAndRowFromIndex(tileIndex, &tileGridIndex);
 
         auto tilePosition = tileGridIndex*tileSet.tileExtent;
-        blitTextImage(tileSet.image, Box2I(tilePosition, tilePosition + tileSet.tileExtent), destPosition, color);
+        recordScreenCommand(RenderCommandType::BlitText, tileSet.image.get(), Box2I::withMinAndExtent(tilePosition, tileSet.tileExtent),
+            Box2I::withMinAndExtent(destPosition, tileSet.tileExtent), color);
     }
 
     void drawString(const std::string &string, const Vector2I &destPosition, uint32_t color)
@@ -182,7 +416,19 @@ public:
         return 0xff000000;
     }
 
-    void renderHUD()
+    // The overlays are recorded in drawing order, including the fade of the post processing.
+    void recordScreenOverlays()
+    {
+        screenRenderCommands.clear();
+        recordHUD();
+        recordMinimap();
+        recordCollisionStatistics();
+        recordActiveMessage();
+        recordFade();
+        recordGameStateMessage();
+    }
+
+    void recordHUD()
     {
         auto tileExtent = global.hudTiles.tileExtent;
 
@@ -213,6 +459,131 @@ public:
         }
     }
 
+    void recordMinimap()
+    {
+        auto transientState = global.mapTransientState;
+        if(!global.isMinimapEnabled || !transientState)
+            return;
+
+        auto &minimap = transientState->minimap;
+        if(!minimap.referenceLayer)
+            return;
+
+        // The whole minimap is shown, downsampled by the smallest integer factor that fits it in the window.
+        auto margin = Vector2I(20);
+        auto maxWindowExtent = std::max(Vector2I::ones(), Vector2I(framebuffer.width/2, framebuffer.height/4));
+        auto factor = std::max((minimap.extent.x + maxWindowExtent.x - 1) / maxWindowExtent.x,
+            (minimap.extent.y + maxWindowExtent.y - 1) / maxWindowExtent.y);
+        auto windowExtent = (minimap.extent + factor - 1) / factor;
+        auto windowPosition = Vector2I(framebuffer.width - windowExtent.x - margin.x, margin.y);
+
+        if(factor != 1 && minimap.downsampleFactor != factor)
+            downsampleMinimapTexels(minimap, factor);
+
+        auto window = Box2I::withMinAndExtent(windowPosition, windowExtent);
+        recordScreenCommand(RenderCommandType::FillRectangle, nullptr, Box2I(), Box2I(window.min - 1, window.max + 1), 0xffcccccc);
+        recordScreenCommand(RenderCommandType::CopyMinimap, nullptr, Box2I(), window, factor);
+
+        auto tileExtent = global.mainTileSet.tileExtent;
+        if(isDefaultTileExtent(tileExtent))
+            recordMinimapMarkers(window, factor, DefaultTileGeometry());
+        else
+            recordMinimapMarkers(window, factor, DynamicTileGeometry(tileExtent));
+    }
+
+    // The markers of the relevant entities.
+    template<typename TG>
+    void recordMinimapMarkers(const Box2I &window, int32_t factor, const TG &tileGeometry)
+    {
+        auto transientState = global.mapTransientState;
+        auto &minimap = transientState->minimap;
+        auto drawMarker = [&](Entity *entity, uint32_t color) {
+            auto tilePosition = minimap.referenceLayer->pointFromWorldIntoTileSpace(entity->position, tileGeometry).floor().asVector2I();
+            if(tilePosition.x < 0 || tilePosition.y < 0 || tilePosition.x >= minimap.extent.x || tilePosition.y >= minimap.extent.y)
+                return;
+
+            auto markerPosition = tilePosition / factor + window.min;
+            recordScreenCommand(RenderCommandType::FillRectangle, nullptr, Box2I(), Box2I(markerPosition - 1, markerPosition + 1).intersectionWithBox(window), color);
+        };
+
+        for(auto entity : transientState->collisionEntities)
+        {
+            if(entity->isEnemy())
+                drawMarker(entity, 0xff0000ff);
+        }
+
+        if(transientState->activeVIP)
+            drawMarker(transientState->activeVIP, 0xff00ffff);
+        if(transientState->activePlayer)
+            drawMarker(transientState->activePlayer, 0xff00ff00);
+    }
+
+    void recordCollisionStatistics()
+    {
+#if ENABLE_COLLISION_STATISTICS
+        static const char *QueryKindNames[NumberOfCollisionQueryKinds] = {
+            "BOX", "RAY", "ENT", "SEN",
+        };
+        static const char *CallerNames[NumberOfCollisionQueryCallers] = {
+            "WORLD",
+#   define ENTITY_BEHAVIOR_TYPE(typeName) #typeName,
+#   include "EntityBehaviorTypes.inc"
+#   undef ENTITY_BEHAVIOR_TYPE
+        };
+
+        auto transientState = global.mapTransientState;
+        if(!global.isCollisionStatisticsOverlayEnabled || !transientState)
+            return;
+
+        // The counts of the last tick. The tests are the tiles or the entity boxes read by the queries.
+        auto &statistics = transientState->collisionStatistics;
+        auto lineHeight = global.hudTiles.tileExtent.y;
+        auto linePosition = Vector2I(20, 20 + 3*lineHeight);
+        char buffer[64];
+        drawString("   CALL TEST HIT", linePosition, 0xffcccccc);
+        linePosition.y += lineHeight;
+        for(int i = 0; i < NumberOfCollisionQueryKinds; ++i)
+        {
+            auto total = statistics.lastTickTotal(CollisionQueryKind(i));
+            sprintf(buffer, "%s%4u%5u%4u", QueryKindNames[i], total.calls, total.tilesVisited + total.entityBoxesTested, total.hits);
+            drawString(buffer, linePosition, 0xff00ffff);
+            linePosition.y += lineHeight;
+        }
+
+        // The sensor overlaps that did not fit in the contacts of a tick.
+        if(transientState->droppedSensorContactCount)
+        {
+            sprintf(buffer, "SEN DROP%5u", transientState->droppedSensorContactCount);
+            drawString(buffer, linePosition, 0xff0000ff);
+            linePosition.y += lineHeight;
+        }
+
+        // The rolling averages of the calls, in the same order.
+        auto &averages = statistics.rollingAverages;
+        sprintf(buffer, "AVG%4.0f%4.0f%4.0f%4.0f", averages[0].calls, averages[1].calls, averages[2].calls, averages[3].calls);
+        drawString(buffer, linePosition, 0xffcccccc);
+        linePosition.y += lineHeight;
+
+        // The entities put to sleep and woken up since the map was loaded.
+        auto &sleepStatistics = transientState->sleepStatistics;
+        sprintf(buffer, "SLP%5u WAK%5u", sleepStatistics.sleepCount, sleepStatistics.wakeCount);
+        drawString(buffer, linePosition, 0xffcccccc);
+        linePosition.y += lineHeight;
+
+        // The callers that did some query in the last tick.
+        for(uint32_t i = 0; i < NumberOfCollisionQueryCallers && linePosition.y + lineHeight <= int32_t(framebuffer.height); ++i)
+        {
+            auto total = statistics.lastTickTotalOfCaller(i);
+            if(!total.calls)
+                continue;
+
+            sprintf(buffer, "%-12.12s%4u", CallerNames[i], total.calls);
+            drawString(buffer, linePosition, 0xff00cc00);
+            linePosition.y += lineHeight;
+        }
+#endif
+    }
+
     void drawCenteredRainbowString(const std::string &string, float wavePhase, size_t rainbowPhase)
     {
         std::vector<std::string> lines;
@@ -253,7 +624,7 @@ public:
         return (remainingExtent*0.5f).asVector2I();
     }
 
-    void renderActiveMessage()
+    void recordActiveMessage()
     {
         auto transientState = global.mapTransientState;
         if(!transientState)
@@ -267,7 +638,7 @@ public:
         }
     }
 
-    void renderGameStateMessage()
+    void recordGameStateMessage()
     {
         auto transientState = global.mapTransientState;
 
@@ -292,7 +663,7 @@ public:
         drawCenteredRainbowString(message, wavePhase, rainbowPhase);
     }
 
-    void postProcess()
+    void recordFade()
     {
         auto transientState = global.mapTransientState;
         if(!transientState)
@@ -312,78 +683,206 @@ public:
 
 
         uint32_t bitMask = fadeChannelMask | (fadeChannelMask<<8) | (fadeChannelMask << 16) | (fadeChannelMask<<24);
+        recordScreenCommand(RenderCommandType::Fade, nullptr, Box2I(), framebuffer.bounds(), bitMask);
+    }
 
-        auto destRow = framebuffer.pixels;
-        for(uint32_t y = 0; y < framebuffer.height; ++y)
-        {
-            auto dest = reinterpret_cast<uint32_t*> (destRow);
-            for(uint32_t x = 0; x < framebuffer.width; ++x)
-            {
-                *dest++ &= bitMask;
-            }
+    static double currentTimeInMilliseconds()
+    {
+        auto now = std::chrono::steady_clock::now().time_since_epoch();
+        return std::chrono::duration<double, std::milli> (now).count();
+    }
 
-            destRow += framebuffer.pitch;
+    void render()
+    {
+        auto &timings = global.lastRenderPassTimings;
+        auto startTime = currentTimeInMilliseconds();
+        global.mainTileSet.updateAnimations(global.currentTime);
+
+        setupViewports();
+        recordCurrentMap();
+        recordScreenOverlays();
+        auto recordingEndTime = currentTimeInMilliseconds();
+        timings.recording = recordingEndTime - startTime;
+
+        if(hasMapRenderCommandsOverflow)
+        {
+            recordAndRenderEachViewport();
+        }
+        else
+        {
+            for(auto &viewport : viewports)
+                renderViewport(viewport);
         }
+        auto viewportsEndTime = currentTimeInMilliseconds();
+        timings.viewports = viewportsEndTime - recordingEndTime;
+
+        clipRectangle = framebuffer.bounds();
+        for(auto &command : screenRenderCommands)
+            replayCommand(command, Vector2I::zeros());
+        timings.overlays = currentTimeInMilliseconds() - viewportsEndTime;
     }
 
-    void render()
+    void recordTileLayer(const MapSolidLayerState &solidLayer)
     {
-        renderBackground();
-        renderCurrentMap();
-        renderHUD();
-        renderActiveMessage();
-        postProcess();
-        renderGameStateMessage();
+        auto tileExtent = global.mainTileSet.tileExtent;
+        if(isDefaultTileExtent(tileExtent))
+            recordTileLayer(solidLayer, DefaultTileGeometry());
+        else
+            recordTileLayer(solidLayer, DynamicTileGeometry(tileExtent));
     }
 
-    void renderTileLayer(const MapFileTileLayer &layer)
+    template<typename TG>
+    void recordTileLayer(const MapSolidLayerState &solidLayer, const TG &tileGeometry)
     {
+        auto &layer = *solidLayer.mapTileLayer;
         auto &tileSet = global.mainTileSet;
-        auto tileExtent = tileSet.tileExtent;
+        auto drawnTileExtent = tileGeometry.drawnTileExtent(mipLevelFor(tileSet));
         auto layerExtent = layer.extent;
-        auto layerOffset = Vector2I(0, -layerExtent.y*tileExtent.y);
+        auto layerOffset = Vector2I(0, -layerExtent.y*drawnTileExtent.y);
 
-        auto viewVolumeInTileSpace = layer.boxFromWorldIntoTileSpace(worldViewVolumeInUnits, tileExtent.asVector2F());
-        auto tileGridBounds = viewVolumeInTileSpace.asBoundingIntegerBox().intersectionWithBox(layer.tileGridBounds());
+        // Compute the visible tile rows and columns of each viewport.
+        FixedVector<Box2I, MaxNumberOfViewports> viewportTileGridBounds;
+        auto rowBounds = Box2I(Vector2I(layerExtent.x, layerExtent.y), Vector2I(0, 0));
+        for(auto &viewport : viewports)
+        {
+            auto viewVolumeInTileSpace = layer.boxFromWorldIntoTileSpace(viewport.worldViewVolume, tileGeometry);
+            auto tileGridBounds = viewVolumeInTileSpace.asBoundingIntegerBox().intersectionWithBox(layer.tileGridBounds());
+            if(tileGridBounds.isEmpty())
+                continue;
+
+            viewportTileGridBounds.push_back(tileGridBounds);
+            rowBounds.min.y = std::min(rowBounds.min.y, tileGridBounds.min.y);
+            rowBounds.max.y = std::max(rowBounds.max.y, tileGridBounds.max.y);
+        }
 
-        auto sourceRow = layer.tiles + tileGridBounds.min.y*layerExtent.x + tileGridBounds.min.x;
-        for(int32_t ly = tileGridBounds.min.y; ly < tileGridBounds.max.y; ++ly)
+        // Visit each tile that is visible in some viewport only once.
+        auto sourceRow = layer.tiles + rowBounds.min.y*layerExtent.x;
+        for(int32_t ly = rowBounds.min.y; ly < rowBounds.max.y; ++ly)
         {
-            auto source = sourceRow;
-            for(int32_t lx = tileGridBounds.min.x; lx < tileGridBounds.max.x; ++lx)
+            int32_t nextColumn = 0;
+            for(;;)
             {
-                auto tileIndex = *source;
-                if(tileIndex > 0)
+                auto spanStart = layerExtent.x;
+                auto spanEnd = 0;
+                for(auto &bounds : viewportTileGridBounds)
+                {
+                    if(ly < bounds.min.y || ly >= bounds.max.y || bounds.max.x <= nextColumn)
+                        continue;
+
+                    auto boundsStart = std::max(bounds.min.x, nextColumn);
+                    if(boundsStart < spanStart)
+                    {
+                        spanStart = boundsStart;
+                        spanEnd = bounds.max.x;
+                    }
+                    else if(boundsStart == spanStart)
+                    {
+                        spanEnd = std::max(spanEnd, bounds.max.x);
+                    }
+                }
+
+                if(spanStart >= spanEnd)
+                    break;
+
+                // The empty blocks of tiles are skipped at once.
+                auto blockY = ly >> TileOccupancyBlockSizeLog2;
+                for(int32_t lx = spanStart; lx < spanEnd; )
                 {
-                    Vector2I tileGridIndex;
-                    if(tileSet.computeTileColumnAndRowFromIndex(tileIndex - 1, &tileGridIndex))
+                    auto blockX = lx >> TileOccupancyBlockSizeLog2;
+                    auto blockEnd = std::min(spanEnd, (blockX + 1) << TileOccupancyBlockSizeLog2);
+                    if(solidLayer.blockOccupancyAt(blockX, blockY) == TileBlockOccupancy::Empty)
                     {
-                        blitTile(tileSet, tileGridIndex, layerOffset + Vector2I(lx, ly)*tileExtent + cameraPixelOffset );
+                        lx = blockEnd;
+                        continue;
+                    }
+
+                    for(; lx < blockEnd; ++lx)
+                    {
+                        auto tileIndex = sourceRow[lx];
+                        if(tileIndex > 0)
+                        {
+                            Vector2I tileGridIndex;
+                            if(tileSet.computeTileColumnAndRowFromIndex(tileSet.animatedTileIndex(tileIndex - 1), &tileGridIndex))
+                            {
+                                blitTile(tileSet, tileGridIndex, layerOffset + Vector2I(lx, ly)*drawnTileExtent);
+                            }
+                        }
                     }
                 }
 
-                ++source;
+                nextColumn = spanEnd;
             }
 
             sourceRow += layerExtent.x;
         }
     }
 
+    static RenderCommand makeCommand(RenderCommandType type, const Image *image, const Box2I &sourceRectangle, const Box2I &destinationRectangle, uint32_t color, bool flipX = false, bool flipY = false)
+    {
+        RenderCommand command;
+        command.type = type;
+        command.flipX = flipX;
+        command.flipY = flipY;
+        command.color = color;
+        command.image = image;
+        command.sourceRectangle = sourceRectangle;
+        command.destinationRectangle = destinationRectangle;
+        return command;
+    }
+
+    void recordMapCommand(const RenderCommand &command)
+    {
+        if(mapRenderCommands.size() == mapRenderCommands.capacity())
+        {
+            if(!flushedViewport)
+            {
+                hasMapRenderCommandsOverflow = true;
+                return;
+            }
+
+            replayMapCommands(*flushedViewport);
+            mapRenderCommands.clear();
+        }
+
+        mapRenderCommands.push_back(command);
+    }
+
+    void recordCommand(RenderCommandType type, const Image &image, const Box2I &sourceRectangle, const Vector2I &destination, uint32_t color, bool flipX, bool flipY)
+    {
+        recordMapCommand(makeCommand(type, &image, sourceRectangle, Box2I::withMinAndExtent(destination, sourceRectangle.extent()), color, flipX, flipY));
+    }
+
+    void recordScreenCommand(RenderCommandType type, const Image *image, const Box2I &sourceRectangle, const Box2I &destinationRectangle, uint32_t color)
+    {
+        screenRenderCommands.push_back(makeCommand(type, image, sourceRectangle, destinationRectangle, color));
+    }
+
+    // Map drawing. These are recorded in map pixel space, and then replayed on each viewport.
     void blitTile(const TileSet &tileSet, const Vector2I &tileGridIndex, const Vector2I &destination, bool flipX = false, bool flipY = false)
     {
-        blitImage(tileSet.image, Box2I::withMinAndExtent(tileSet.tileExtent*tileGridIndex, tileSet.tileExtent), destination, flipX, flipY);
+        auto mipLevel = mipLevelFor(tileSet);
+        auto tileExtent = tileSet.mipLevelTileExtent(mipLevel);
+        recordCommand(RenderCommandType::Blit, tileSet.mipLevelImage(mipLevel), Box2I::withMinAndExtent(tileExtent*tileGridIndex, tileExtent), destination, 0, flipX, flipY);
     }
 
     void blitTextTile(const TileSet &tileSet, const Vector2I &tileGridIndex, const Vector2I &destination, uint32_t color, bool flipX = false, bool flipY = false)
     {
-        blitTextImage(tileSet.image, Box2I::withMinAndExtent(tileSet.tileExtent*tileGridIndex, tileSet.tileExtent), destination, color, flipX, flipY);
+        auto mipLevel = mipLevelFor(tileSet);
+        auto tileExtent = tileSet.mipLevelTileExtent(mipLevel);
+        recordCommand(RenderCommandType::BlitText, tileSet.mipLevelImage(mipLevel), Box2I::withMinAndExtent(tileExtent*tileGridIndex, tileExtent), destination, color, flipX, flipY);
+    }
+
+    void fillWorldRectangle(const Box2F &rectangle, uint32_t color)
+    {
+        recordMapCommand(makeCommand(RenderCommandType::FillRectangle, nullptr, Box2I(), worldToViewPixels(rectangle).asBox2I(), color));
     }
 
-    void blitImage(const ImagePtr &image, const Box2I &sourceRectangle, const Vector2I &destination, bool flipX = false, bool flipY = false)
+    // Immediate drawing into the framebuffer, clipped by the current clip rectangle.
+    void blitImage(const Image &image, const Box2I &sourceRectangle, const Vector2I &destination, bool flipX = false, bool flipY = false)
     {
         auto extent = sourceRectangle.extent();
         auto destRectangle = Box2I::withMinAndExtent(destination, sourceRectangle.extent());
-        auto clippedDest = destRectangle.intersectionWithBox(framebuffer.bounds());
+        auto clippedDest = destRectangle.intersectionWithBox(clipRectangle);
         if(clippedDest.isEmpty())
             return;
 
@@ -391,32 +890,49 @@ public:
         auto clippedSource = Box2I(sourceRectangle.min + copyOffset, sourceRectangle.max);
 
         auto destRow = framebuffer.pixels + framebuffer.pitch*clippedDest.min.y + clippedDest.min.x*4;
-        auto sourceRow = image->data.get();
+        auto sourceRow = image.data.get();
         if(flipX)
             sourceRow += (sourceRectangle.min.x + (extent.x - copyOffset.x - 1))*4;
         else
             sourceRow += clippedSource.min.x*4;
 
         if(flipY)
-            sourceRow += image->pitch*(sourceRectangle.min.y + (extent.y - copyOffset.y - 1));
+            sourceRow += image.pitch*(sourceRectangle.min.y + (extent.y - copyOffset.y - 1));
         else
-            sourceRow += image->pitch*clippedSource.min.y;
+            sourceRow += image.pitch*clippedSource.min.y;
 
         auto sourceRowIncrement = flipX ? -1 : 1;
-        auto sourcePitch = flipY ? int(-image->pitch) : int(image->pitch);
+        auto sourcePitch = flipY ? int(-image.pitch) : int(image.pitch);
 
+        auto rowWidth = clippedDest.max.x - clippedDest.min.x;
         for(int32_t y = clippedDest.min.y; y < clippedDest.max.y; ++y)
         {
             auto dest = reinterpret_cast<uint32_t*> (destRow);
             auto source = reinterpret_cast<uint32_t*> (sourceRow);
-            for(int32_t x = clippedDest.min.x; x < clippedDest.max.x; ++x)
+            switch(image.alphaClass)
             {
-                auto sourcePixel = *source;
-                auto alpha = (sourcePixel >> 24) & 0xff;
-                if(alpha > 0x80)
-                    *dest = sourcePixel;
-                ++dest;
-                source += sourceRowIncrement;
+            case ImageAlphaClass::Opaque:
+                if(!flipX)
+                {
+                    memcpy(dest, source, rowWidth*4);
+                    break;
+                }
+
+                for(int32_t x = 0; x < rowWidth; ++x, --source)
+                    dest[x] = *source;
+                break;
+            case ImageAlphaClass::BinaryAlpha:
+                for(int32_t x = 0; x < rowWidth; ++x, source += sourceRowIncrement)
+                {
+                    auto sourcePixel = *source;
+                    auto alpha = (sourcePixel >> 24) & 0xff;
+                    if(alpha > 0x80)
+                        dest[x] = sourcePixel;
+                }
+                break;
+            case ImageAlphaClass::Translucent:
+                blendPremultipliedRow(dest, source, rowWidth, sourceRowIncrement);
+                break;
             }
 
             destRow += framebuffer.pitch;
@@ -424,11 +940,11 @@ public:
         }
     }
 
-    void blitTextImage(const ImagePtr &image, const Box2I &sourceRectangle, const Vector2I &destination, uint32_t textColor, bool flipX = false, bool flipY = false)
+    void blitTextImage(const Image &image, const Box2I &sourceRectangle, const Vector2I &destination, uint32_t textColor, bool flipX = false, bool flipY = false)
     {
         auto extent = sourceRectangle.extent();
         auto destRectangle = Box2I::withMinAndExtent(destination, sourceRectangle.extent());
-        auto clippedDest = destRectangle.intersectionWithBox(framebuffer.bounds());
+        auto clippedDest = destRectangle.intersectionWithBox(clipRectangle);
         if(clippedDest.isEmpty())
             return;
 
@@ -436,19 +952,19 @@ public:
         auto clippedSource = Box2I(sourceRectangle.min + copyOffset, sourceRectangle.max);
 
         auto destRow = framebuffer.pixels + framebuffer.pitch*clippedDest.min.y + clippedDest.min.x*4;
-        auto sourceRow = image->data.get();
+        auto sourceRow = image.data.get();
         if(flipX)
             sourceRow += (sourceRectangle.min.x + (extent.x - copyOffset.x - 1))*4;
         else
             sourceRow += clippedSource.min.x*4;
 
         if(flipY)
-            sourceRow += image->pitch*(sourceRectangle.min.y + (extent.y - copyOffset.y - 1));
+            sourceRow += image.pitch*(sourceRectangle.min.y + (extent.y - copyOffset.y - 1));
         else
-            sourceRow += image->pitch*clippedSource.min.y;
+            sourceRow += image.pitch*clippedSource.min.y;
 
         auto sourceRowIncrement = flipX ? -1 : 1;
-        auto sourcePitch = flipY ? int(-image->pitch) : int(image->pitch);
+        auto sourcePitch = flipY ? int(-image.pitch) : int(image.pitch);
 
         for(int32_t y = clippedDest.min.y; y < clippedDest.max.y; ++y)
         {
@@ -469,28 +985,106 @@ public:
         }
     }
 
-    void fillWorldRectangle(const Box2F &rectangle, uint32_t color)
-    {
-        fillRectangle(worldToViewPixels(rectangle).asBox2I(), color);
-    }
-
     void fillRectangle(const Box2I &rectangle, uint32_t color)
     {
-        auto clippedRectangle = rectangle.intersectionWithBox(framebuffer.bounds());
+        auto clippedRectangle = rectangle.intersectionWithBox(clipRectangle);
         if(clippedRectangle.isEmpty())
             return;
 
         auto alpha = (color >> 24) & 0xff;
-        if(alpha < 0x80)
+        if(alpha == 0)
             return;
 
+        // Translucent colors are used for overlays and shadows.
+        auto premultipliedColor = premultiplyPixelAlpha(color);
         auto destRow = framebuffer.pixels + framebuffer.pitch*clippedRectangle.min.y + clippedRectangle.min.x*4;
         for(int32_t y = clippedRectangle.min.y; y < clippedRectangle.max.y; ++y)
         {
             auto dest = reinterpret_cast<uint32_t*> (destRow);
             for(int32_t x = clippedRectangle.min.x; x < clippedRectangle.max.x; ++x)
             {
-                *dest++ = color;
+                if(alpha == 0xff)
+                    *dest = color;
+                else
+                    *dest = blendPremultipliedPixel(*dest, premultipliedColor);
+                ++dest;
+            }
+
+            destRow += framebuffer.pitch;
+        }
+    }
+
+    // Each downsampled texel is the average of a square of factor x factor texels.
+    static void downsampleMinimapTexels(MapMinimapState &minimap, int32_t factor)
+    {
+        minimap.downsampleFactor = factor;
+        minimap.downsampledExtent = (minimap.extent + factor - 1) / factor;
+        auto dest = minimap.downsampledTexels;
+        for(int32_t y = 0; y < minimap.downsampledExtent.y; ++y)
+        {
+            auto sourceMinY = y*factor;
+            auto sourceMaxY = std::min(sourceMinY + factor, minimap.extent.y);
+            for(int32_t x = 0; x < minimap.downsampledExtent.x; ++x)
+            {
+                auto sourceMinX = x*factor;
+                auto sourceMaxX = std::min(sourceMinX + factor, minimap.extent.x);
+                uint32_t channelSums[3] = {0, 0, 0};
+                for(int32_t sourceY = sourceMinY; sourceY < sourceMaxY; ++sourceY)
+                {
+                    auto source = minimap.texels + sourceY*minimap.extent.x;
+                    for(int32_t sourceX = sourceMinX; sourceX < sourceMaxX; ++sourceX)
+                    {
+                        auto texel = source[sourceX];
+                        channelSums[0] += texel & 0xff;
+                        channelSums[1] += (texel >> 8) & 0xff;
+                        channelSums[2] += (texel >> 16) & 0xff;
+                    }
+                }
+
+                uint32_t texelCount = (sourceMaxX - sourceMinX)*(sourceMaxY - sourceMinY);
+                *dest++ = 0xff000000 |
+                    ((channelSums[2] / texelCount) << 16) |
+                    ((channelSums[1] / texelCount) << 8) |
+                    (channelSums[0] / texelCount);
+            }
+        }
+    }
+
+    // The texels for the factor are already downsampled when recording.
+    void copyMinimapTexels(int32_t factor, const Box2I &window)
+    {
+        auto &minimap = global.mapTransientState->minimap;
+        auto clippedWindow = window.intersectionWithBox(clipRectangle);
+        if(clippedWindow.isEmpty())
+            return;
+
+        auto sourceTexels = factor == 1 ? minimap.texels : minimap.downsampledTexels;
+        auto sourcePitch = factor == 1 ? minimap.extent.x : minimap.downsampledExtent.x;
+        auto copyOffset = clippedWindow.min - window.min;
+        auto copyWidth = clippedWindow.max.x - clippedWindow.min.x;
+        auto destRow = framebuffer.pixels + framebuffer.pitch*clippedWindow.min.y + clippedWindow.min.x*4;
+        auto sourceRow = sourceTexels + copyOffset.y*sourcePitch + copyOffset.x;
+        for(int32_t y = clippedWindow.min.y; y < clippedWindow.max.y; ++y)
+        {
+            memcpy(destRow, sourceRow, copyWidth*4);
+            sourceRow += sourcePitch;
+            destRow += framebuffer.pitch;
+        }
+    }
+
+    void fadeRectangle(const Box2I &rectangle, uint32_t bitMask)
+    {
+        auto clippedRectangle = rectangle.intersectionWithBox(clipRectangle);
+        if(clippedRectangle.isEmpty())
+            return;
+
+        auto destRow = framebuffer.pixels + framebuffer.pitch*clippedRectangle.min.y + clippedRectangle.min.x*4;
+        for(int32_t y = clippedRectangle.min.y; y < clippedRectangle.max.y; ++y)
+        {
+            auto dest = reinterpret_cast<uint32_t*> (destRow);
+            for(int32_t x = clippedRectangle.min.x; x < clippedRectangle.max.x; ++x)
+            {
+                *dest++ &= bitMask;
             }
 
             destRow += framebuffer.pitch;
@@ -512,8 +1106,8 @@ void EntityBehavior::renderWith(Entity *self, Renderer &renderer)
     if(canUseAPistol())
     {
         auto weaponDirection = (self->halfExtent + 0.15f)*self->lookDirection.normalized();
-        auto spriteOffset = global.itemsSprites.tileExtent.asVector2F()*0.5f;
-        auto weaponDisplayPosition = (renderer.worldToViewPixels(self->position+ self->spriteOffset + weaponDirection) - spriteOffset).asVector2I();
+        auto spriteOffset = renderer.zoomedTileExtent(global.itemsSprites).asVector2F()*0.5f;
+        auto weaponDisplayPosition = (renderer.worldToViewPixels(self->position+ self->spriteOffset + weaponDirection) - spriteOffset).floor().asVector2I();
 
         if(self->lookDirection.y != 0)
             renderer.blitTile(global.itemsSprites, Vector2I(2, 0), weaponDisplayPosition, false, self->lookDirection.y < 0);
@@ -523,8 +1117,8 @@ void EntityBehavior::renderWith(Entity *self, Renderer &renderer)
 
     if(self->spriteSheet)
     {
-        auto spriteOffset = self->spriteSheet->tileExtent.asVector2F()*0.5f;
-        auto spriteDestination = (renderer.worldToViewPixels(self->position + self->spriteOffset) - spriteOffset).asVector2I();
+        auto spriteOffset = renderer.zoomedTileExtent(*self->spriteSheet).asVector2F()*0.5f;
+        auto spriteDestination = (renderer.worldToViewPixels(self->position + self->spriteOffset) - spriteOffset).floor().asVector2I();
 
         if(self->isInvincible())
             renderer.blitTextTile(*self->spriteSheet, self->spriteIndex, spriteDestination, 0xffffffff, self->spriteFlipX, self->spriteFlipY);
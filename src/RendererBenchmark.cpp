@@ -0,0 +1,188 @@
+// Headless renderer benchmark. It sweeps the camera through each level, and
+// renders into in-memory framebuffers of different resolutions.
+// The results are written into the standard output in CSV format.
+#include "SDL.h"
+#include "SDL_image.h"
+
+#include "HostInterface.hpp"
+#include "SDL2AssetLoading.hpp"
+#include "GameInterface.hpp"
+#include "GameLogic.hpp"
+#include "MapTransientState.hpp"
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+extern "C" GameInterface *getGameInterface();
+
+struct BenchmarkLevel
+{
+    LevelID id;
+    const char *name;
+};
+
+static const BenchmarkLevel BenchmarkLevels[] = {
+    {LevelID::Test, "test"},
+    {LevelID::DonMeowth, "donMeowth"},
+    {LevelID::MrPresident, "mrPresident"},
+};
+
+static const Vector2I BenchmarkResolutions[] = {
+    Vector2I(320, 240),
+    Vector2I(640, 480),
+    Vector2I(1280, 720),
+    Vector2I(1920, 1080),
+};
+
+static const int WarmupFrameCount = 30;
+static int SweepFrameCount = 600;
+
+static MemoryZone persistentMemory;
+static MemoryZone transientMemory;
+
+class BenchmarkHostInterface : public HostInterface
+{
+public:
+    virtual MapFile *loadMapFile(const char *fileName) override;
+    virtual Image *loadImage(const char *fileName) override;
+    virtual SoundSample *loadSoundSample(const char *fileName) override;
+
+    static BenchmarkHostInterface singleton;
+};
+
+BenchmarkHostInterface BenchmarkHostInterface::singleton;
+
+MapFile *BenchmarkHostInterface::loadMapFile(const char *fileName)
+{
+    return loadMapFileAsset(fileName);
+}
+
+Image *BenchmarkHostInterface::loadImage(const char *fileName)
+{
+    return loadImageAsset(fileName);
+}
+
+SoundSample *BenchmarkHostInterface::loadSoundSample(const char *fileName)
+{
+    (void)fileName;
+    return new NullSoundSample;
+}
+
+static double currentTimeInMilliseconds()
+{
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+    return std::chrono::duration<double, std::milli> (now).count();
+}
+
+static double percentile(const std::vector<double> &sortedSamples, double fraction)
+{
+    auto index = size_t(fraction*(sortedSamples.size() - 1) + 0.5);
+    return sortedSamples[std::min(index, sortedSamples.size() - 1)];
+}
+
+// A fixed path that crosses the whole map from left to right, while waving vertically.
+static Vector2F cameraPathPoint(int frameIndex, int frameCount)
+{
+    auto mapExtent = global.currentMap->extent().asVector2F()*UnitsPerPixel;
+    auto alpha = float(frameIndex) / float(std::max(frameCount - 1, 1));
+    auto wave = sinf(alpha*float(M_PI)*8.0f);
+    return Vector2F(mapExtent.x*alpha, mapExtent.y*(0.5f + wave*0.25f));
+}
+
+static void benchmarkLevel(const BenchmarkLevel &level)
+{
+    global.currentLevelID = level.id;
+    startNewMap();
+
+    // Skip the fade in and the level title message.
+    auto transientState = global.mapTransientState;
+    transientState->timeInMap = 1.0f;
+    transientState->currentMessageRemainingTime = 0.0f;
+
+    auto gameInterface = getGameInterface();
+    for(auto &resolution : BenchmarkResolutions)
+    {
+        std::unique_ptr<uint8_t[]> pixels(new uint8_t[resolution.x*resolution.y*4]);
+
+        Framebuffer framebuffer;
+        framebuffer.width = resolution.x;
+        framebuffer.height = resolution.y;
+        framebuffer.pitch = resolution.x*4;
+        framebuffer.pixels = pixels.get();
+
+        for(int i = 0; i < WarmupFrameCount; ++i)
+        {
+            global.cameraPosition = cameraPathPoint(0, SweepFrameCount);
+            gameInterface->render(framebuffer);
+        }
+
+        std::vector<double> frameTimes;
+        frameTimes.reserve(SweepFrameCount);
+        RenderPassTimings totalPassTimings = {};
+        for(int i = 0; i < SweepFrameCount; ++i)
+        {
+            global.cameraPosition = cameraPathPoint(i, SweepFrameCount);
+
+            auto startTime = currentTimeInMilliseconds();
+            gameInterface->render(framebuffer);
+            frameTimes.push_back(currentTimeInMilliseconds() - startTime);
+
+            auto &passTimings = global.lastRenderPassTimings;
+            totalPassTimings.recording += passTimings.recording;
+            totalPassTimings.viewports += passTimings.viewports;
+            totalPassTimings.overlays += passTimings.overlays;
+        }
+
+        double totalTime = 0.0;
+        for(auto time : frameTimes)
+            totalTime += time;
+        std::sort(frameTimes.begin(), frameTimes.end());
+
+        auto frameCount = double(SweepFrameCount);
+        printf("%s,%d,%d,%d,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f\n",
+            level.name, resolution.x, resolution.y, SweepFrameCount,
+            totalTime/frameCount,
+            percentile(frameTimes, 0.5), percentile(frameTimes, 0.9), percentile(frameTimes, 0.99),
+            frameTimes.back(),
+            totalPassTimings.recording/frameCount,
+            totalPassTimings.viewports/frameCount,
+            totalPassTimings.overlays/frameCount);
+        fflush(stdout);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    if(argc > 1)
+        SweepFrameCount = std::max(atoi(argv[1]), 1);
+
+    IMG_Init(IMG_INIT_PNG);
+
+    persistentMemory.reserve(PersistentMemorySize);
+    transientMemory.reserve(TransientMemorySize);
+
+    auto gameInterface = getGameInterface();
+    gameInterface->setPersistentMemory(&persistentMemory);
+    gameInterface->setTransientMemory(&transientMemory);
+    gameInterface->setHostInterface(&BenchmarkHostInterface::singleton);
+
+    // The first update loads the assets.
+    gameInterface->update(0.0f, ControllerState());
+    if(!global.isInitialized)
+    {
+        fprintf(stderr, "Failed to initialize the game state\n");
+        return 1;
+    }
+
+    printf("map,width,height,frames,mean_ms,p50_ms,p90_ms,p99_ms,max_ms,recording_ms,viewports_ms,overlays_ms\n");
+    for(auto &level : BenchmarkLevels)
+        benchmarkLevel(level);
+
+    IMG_Quit();
+    return 0;
+}
@@ -0,0 +1,72 @@
+#include "SDL.h"
+#include "SDL_image.h"
+
+#include "SDL2AssetLoading.hpp"
+#include <stdio.h>
+#include <string.h>
+
+std::string makeFullAssetPath(const std::string &virtualPath)
+{
+    return "assets/" + virtualPath;
+}
+
+MapFile *loadMapFileAsset(const char *fileName)
+{
+    auto fullPath = makeFullAssetPath(fileName);
+    auto file = fopen(fullPath.c_str(), "rb");
+    if(!file)
+    {
+        fprintf(stderr, "Failed to load map file from: %s\n", fullPath.c_str());
+        return nullptr;
+    }
+
+    fseek(file, 0, SEEK_END);
+    auto fileSize = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    std::unique_ptr<MapFile> result(new MapFile());
+    result->mapFileSize = fileSize;
+    result->mapFileContent.reset(new uint8_t[fileSize]);
+
+    auto readSucceeded = fread(result->mapFileContent.get(), fileSize, 1, file) == 1;
+    fclose(file);
+    if(!readSucceeded)
+    {
+        fprintf(stderr, "Failed read the content from map file %s\n", fullPath.c_str());
+        return nullptr;
+    }
+
+    if(!result->validate())
+    {
+        fprintf(stderr, "Map file %s is invalid\n", fullPath.c_str());
+        return nullptr;
+    }
+
+    return result.release();
+}
+
+Image *loadImageAsset(const char *fileName)
+{
+    auto fullPath = makeFullAssetPath(fileName);
+    auto surface = IMG_Load(fullPath.c_str());
+    if(!surface)
+    {
+        fprintf(stderr, "Failed to load image %s: %s\n", fileName, IMG_GetError());
+        return nullptr;
+    }
+
+    auto expectedSurface = SDL_ConvertSurfaceFormat(surface, SDL_PIXELFORMAT_ABGR8888, 0);
+    SDL_FreeSurface(surface);
+
+    auto result = ImagePtr(new Image);
+    result->width = expectedSurface->w;
+    result->height = expectedSurface->h;
+    result->pitch = expectedSurface->pitch;
+    result->bpp = expectedSurface->format->BitsPerPixel;
+    result->data.reset(new uint8_t[result->pitch*result->height]);
+    memcpy(result->data.get(), expectedSurface->pixels, result->pitch*result->height);
+    SDL_FreeSurface(expectedSurface);
+
+    result->premultiplyAlphaAndClassify();
+    return result.release();
+}
@@ -0,0 +1,27 @@
+#ifndef SDL2_ASSET_LOADING_HPP
+#define SDL2_ASSET_LOADING_HPP
+
+#include "HostInterface.hpp"
+#include <string>
+
+// The asset loading shared by the game and the renderer benchmark.
+std::string makeFullAssetPath(const std::string &virtualPath);
+MapFile *loadMapFileAsset(const char *fileName);
+Image *loadImageAsset(const char *fileName);
+
+// A sound sample that does nothing, for the missing samples and the hosts without audio.
+class NullSoundSample : public SoundSample
+{
+public:
+    virtual void play(bool looped, float volume) override
+    {
+        (void) looped;
+        (void) volume;
+    }
+
+    virtual void resume() override {}
+    virtual void pause() override {}
+    virtual void stop() override {}
+};
+
+#endif //SDL2_ASSET_LOADING_HPP
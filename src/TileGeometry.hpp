@@ -0,0 +1,79 @@
+#ifndef TILE_GEOMETRY_HPP
+#define TILE_GEOMETRY_HPP
+
+#include "Vector2.hpp"
+#include "Coordinates.hpp"
+
+// Tile extent known at compile time. The tile space transforms turn into
+// multiplications by constants, which are exact for power of two extents.
+template<int TW, int TH>
+struct StaticTileGeometry
+{
+    enum {
+        Width = TW,
+        Height = TH,
+    };
+
+    Vector2F tileExtent() const
+    {
+        return Vector2F(TW, TH);
+    }
+
+    Vector2F tilesPerUnit() const
+    {
+        return Vector2F(PixelsPerUnit / TW, PixelsPerUnit / TH);
+    }
+
+    Vector2F unitsPerTile() const
+    {
+        return Vector2F(TW * UnitsPerPixel, TH * UnitsPerPixel);
+    }
+
+    Vector2I drawnTileExtent(uint32_t mipLevel) const
+    {
+        return Vector2I(TW >> mipLevel, TH >> mipLevel);
+    }
+};
+
+// The shipping tile sets use 32x32 tiles.
+typedef StaticTileGeometry<32, 32> DefaultTileGeometry;
+
+// Fallback for a tile extent that is only known at run time.
+struct DynamicTileGeometry
+{
+    DynamicTileGeometry(const Vector2I &theExtent)
+        : extent(theExtent),
+          tilesPerUnit_(PixelsPerUnit / theExtent.x, PixelsPerUnit / theExtent.y),
+          unitsPerTile_(theExtent.x * UnitsPerPixel, theExtent.y * UnitsPerPixel) {}
+
+    Vector2F tileExtent() const
+    {
+        return extent.asVector2F();
+    }
+
+    Vector2F tilesPerUnit() const
+    {
+        return tilesPerUnit_;
+    }
+
+    Vector2F unitsPerTile() const
+    {
+        return unitsPerTile_;
+    }
+
+    Vector2I drawnTileExtent(uint32_t mipLevel) const
+    {
+        return Vector2I(extent.x >> mipLevel, extent.y >> mipLevel);
+    }
+
+    Vector2I extent;
+    Vector2F tilesPerUnit_;
+    Vector2F unitsPerTile_;
+};
+
+inline bool isDefaultTileExtent(const Vector2I &extent)
+{
+    return extent.x == DefaultTileGeometry::Width && extent.y == DefaultTileGeometry::Height;
+}
+
+#endif //TILE_GEOMETRY_HPP
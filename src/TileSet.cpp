@@ -7,4 +7,125 @@ void TileSet::loadFrom(const char *path, uint32_t tw, uint32_t th)
     image.reset(hostInterface->loadImage(path));
     tileExtent = Vector2I(tw, th);
     gridExtent = Vector2I(image->width, image->height) / tileExtent;
+
+    tileCount = gridExtent.x*gridExtent.y;
+    tileRemapTable.reset(new uint16_t[tileCount]);
+    for(uint32_t i = 0; i < tileCount; ++i)
+        tileRemapTable[i] = i;
+    animations.clear();
+
+    computeTileAverageColors();
+    buildMipLevels();
+}
+
+void TileSet::buildMipLevels()
+{
+    mipLevelCount = 1;
+    for(uint32_t level = 1; level < MaxNumberOfTileSetMipLevels; ++level)
+    {
+        // The tiles must be split evenly, so that the filter never mixes neighbour tiles.
+        auto parentTileExtent = mipLevelTileExtent(level - 1);
+        if((parentTileExtent.x & 1) || (parentTileExtent.y & 1))
+            break;
+
+        auto &parent = mipLevelImage(level - 1);
+        auto mipImage = ImagePtr(new Image);
+        mipImage->width = gridExtent.x*parentTileExtent.x/2;
+        mipImage->height = gridExtent.y*parentTileExtent.y/2;
+        mipImage->pitch = mipImage->width*4;
+        mipImage->bpp = 32;
+        mipImage->data.reset(new uint8_t[mipImage->pitch*mipImage->height]);
+
+        auto destRow = mipImage->data.get();
+        auto sourceRow = parent.data.get();
+        for(uint32_t y = 0; y < mipImage->height; ++y)
+        {
+            auto dest = reinterpret_cast<uint32_t*> (destRow);
+            auto topSource = reinterpret_cast<const uint32_t*> (sourceRow);
+            auto bottomSource = reinterpret_cast<const uint32_t*> (sourceRow + parent.pitch);
+            for(uint32_t x = 0; x < mipImage->width; ++x)
+            {
+                auto topLeft = topSource[x*2];
+                auto topRight = topSource[x*2 + 1];
+                auto bottomLeft = bottomSource[x*2];
+                auto bottomRight = bottomSource[x*2 + 1];
+
+                // Average the premultiplied channels, two of them at a time.
+                auto redBlue = (topLeft & 0x00ff00ff) + (topRight & 0x00ff00ff) + (bottomLeft & 0x00ff00ff) + (bottomRight & 0x00ff00ff) + 0x00020002;
+                auto greenAlpha = ((topLeft >> 8) & 0x00ff00ff) + ((topRight >> 8) & 0x00ff00ff) + ((bottomLeft >> 8) & 0x00ff00ff) + ((bottomRight >> 8) & 0x00ff00ff) + 0x00020002;
+                dest[x] = ((redBlue >> 2) & 0x00ff00ff) | ((greenAlpha << 6) & 0xff00ff00);
+            }
+
+            destRow += mipImage->pitch;
+            sourceRow += parent.pitch*2;
+        }
+
+        mipImage->classifyAlpha();
+        mipImages[level - 1] = std::move(mipImage);
+        mipLevelCount = level + 1;
+    }
+}
+
+void TileSet::computeTileAverageColors()
+{
+    tileAverageColors.reset(new uint32_t[tileCount]);
+    for(uint32_t i = 0; i < tileCount; ++i)
+    {
+        Vector2I tileGridIndex;
+        computeTileColumnAndRowFromIndex(i, &tileGridIndex);
+
+        uint32_t pixelCount = 0;
+        uint32_t channelSums[3] = {0, 0, 0};
+        auto sourceRow = image->data.get() + image->pitch*tileGridIndex.y*tileExtent.y + tileGridIndex.x*tileExtent.x*4;
+        for(int32_t y = 0; y < tileExtent.y; ++y)
+        {
+            auto source = reinterpret_cast<const uint32_t*> (sourceRow);
+            for(int32_t x = 0; x < tileExtent.x; ++x)
+            {
+                auto pixel = source[x];
+                if(((pixel >> 24) & 0xff) <= 0x80)
+                    continue;
+
+                channelSums[0] += pixel & 0xff;
+                channelSums[1] += (pixel >> 8) & 0xff;
+                channelSums[2] += (pixel >> 16) & 0xff;
+                ++pixelCount;
+            }
+
+            sourceRow += image->pitch;
+        }
+
+        if(pixelCount == 0)
+        {
+            tileAverageColors[i] = 0;
+            continue;
+        }
+
+        tileAverageColors[i] = 0xff000000 |
+            ((channelSums[2] / pixelCount) << 16) |
+            ((channelSums[1] / pixelCount) << 8) |
+            (channelSums[0] / pixelCount);
+    }
+}
+
+void TileSet::addAnimation(uint16_t firstTileIndex, uint16_t frameCount, float frameDuration)
+{
+    if(frameCount == 0 || !(frameDuration > 0.0f) || firstTileIndex + frameCount > tileCount)
+        return;
+
+    TileAnimation animation;
+    animation.firstTileIndex = firstTileIndex;
+    animation.frameCount = frameCount;
+    animation.frameDuration = frameDuration;
+    animations.push_back(animation);
+}
+
+void TileSet::updateAnimations(float time)
+{
+    for(auto &animation : animations)
+    {
+        auto currentFrame = uint32_t(time / animation.frameDuration) % animation.frameCount;
+        for(uint32_t i = 0; i < animation.frameCount; ++i)
+            tileRemapTable[animation.firstTileIndex + i] = animation.firstTileIndex + (i + currentFrame) % animation.frameCount;
+    }
 }
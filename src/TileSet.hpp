@@ -4,16 +4,62 @@
 #include "Image.hpp"
 #include "HostInterface.hpp"
 #include "Vector2.hpp"
+#include "FixedVector.hpp"
+
+enum {
+    MaxNumberOfTileAnimations = 32,
+    MaxNumberOfTileSetMipLevels = 3,
+};
+
+// An animation made by consecutive tiles in the tile set.
+struct TileAnimation
+{
+    uint16_t firstTileIndex;
+    uint16_t frameCount;
+    float frameDuration;
+};
 
 class TileSet
 {
 public:
     void loadFrom(const char *path, uint32_t tw = 32, uint32_t th = 32);
 
+    void addAnimation(uint16_t firstTileIndex, uint16_t frameCount, float frameDuration);
+    void updateAnimations(float time);
+    void computeTileAverageColors();
+    void buildMipLevels();
+
     ImagePtr image;
     Vector2I tileExtent;
     Vector2I gridExtent;
 
+    // Box filtered copies of the image, where each level halves the tile extent.
+    uint32_t mipLevelCount;
+    ImagePtr mipImages[MaxNumberOfTileSetMipLevels - 1];
+
+    // The average color of the opaque pixels of each tile.
+    std::unique_ptr<uint32_t[]> tileAverageColors;
+
+    // Maps each tile into its current animation frame.
+    uint32_t tileCount;
+    std::unique_ptr<uint16_t[]> tileRemapTable;
+    FixedVector<TileAnimation, MaxNumberOfTileAnimations> animations;
+
+    const Image &mipLevelImage(uint32_t level) const
+    {
+        return level == 0 ? *image : *mipImages[level - 1];
+    }
+
+    Vector2I mipLevelTileExtent(uint32_t level) const
+    {
+        return Vector2I(tileExtent.x >> level, tileExtent.y >> level);
+    }
+
+    uint32_t animatedTileIndex(uint32_t tileIndex) const
+    {
+        return tileIndex < tileCount ? tileRemapTable[tileIndex] : tileIndex;
+    }
+
     bool computeTileColumnAndRowFromIndex(uint32_t tileIndex, Vector2I *outTileGridIndex)
     {
         *outTileGridIndex = Vector2I(tileIndex % gridExtent.x, tileIndex / gridExtent.x);